@@ -60,11 +60,20 @@ enum Compatibility
 
 #define STANDBY_INTERRUPT_RATE 2.0e-4 // Seconds
 
-#define NUMBER_OF_PROBE_POINTS 4
+#define NUMBER_OF_PROBE_POINTS 16 // Exactly 4 gives a ruled surface through the corners; 3 or more otherwise gives a least-squares plane
 #define Z_DIVE 5.0  // Height from which to probe the bed (mm)
+#define Z_PROBE_FAST_FACTOR 4.0 // The first approach to the bed, and travel in Z, is this many times the Z homing speed
+#define Z_PROBE_RETRACT 1.0 // Back off this far (mm) after the fast approach before the slow touch
 
 #define SILLY_Z_VALUE -9999.0
 
+#define GRID_MAX_X 10 // Most points along X in the bed compensation grid
+#define GRID_MAX_Y 10 // Most points along Y
+#define GRID_MIN_SEGMENT 0.5 // mm - moves are split at grid cell boundaries, but not into pieces shorter than this
+
+#define ARC_SEGMENT_LENGTH 1.0 // mm - G2/G3 arcs are made of straight chords about this long
+#define ARC_CORRECTION 25 // Chords between exact recalculations of the arc's radius vector
+
 // Webserver stuff
 
 //#define NETWORK true // Set true to turn the ethernet on
@@ -73,6 +82,7 @@ enum Compatibility
 #define DEFAULT_NAME "My RepRap 1"
 #define INDEX_PAGE "reprap.htm"
 #define MESSAGE_FILE "messages.txt"
+#define UNDERRUN_FILE "underrun.log" // Move queue underruns are appended to this in the system directory
 #define FOUR04_FILE "html404.htm"
 #define CONFIG_FILE "config.g" // The file that sets the machine's parameters
 #define HOME_X_G "homex.g"
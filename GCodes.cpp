@@ -61,6 +61,7 @@ void GCodes::Init()
   for(int8_t i = 0; i < DRIVES - AXES; i++)
     lastPos[i] = 0.0;
   fileBeingPrinted = NULL;
+  parsedFilePosition = 0;
   fileToPrint = NULL;
   fileBeingWritten = NULL;
   configFile = NULL;
@@ -73,11 +74,17 @@ void GCodes::Init()
   homeZ = false;
   homeAxisMoveCount = 0;
   offSetSet = false;
+  moveArc = noArc;
   dwellWaiting = false;
   stackPointer = 0;
   selectedHead = -1;
+  for(int8_t head = 0; head < DRIVES - AXES; head++)
+	  for(int8_t axis = 0; axis < AXES; axis++)
+		  toolOffsets[head][axis] = 0.0;
   gFeedRate = platform->MaxFeedrate(Z_AXIS); // Typically the slowest
   zProbesSet = false;
+  probeMovesChained = false;
+  probingGrid = false;
   probeCount = 0;
   cannedCycleMoveCount = 0;
   cannedCycleMoveQueued = false;
@@ -95,11 +102,17 @@ void GCodes::doFilePrint(GCodeBuffer* gb)
 		if(fileBeingPrinted->Read(b))
 		{
 			if(gb->Put(b))
+			{
+				parsedFilePosition = fileBeingPrinted->Position();
 				gb->SetFinished(ActOnGcode(gb));
+			}
 		} else
 		{
 			if(gb->Put('\n')) // In case there wasn't one ending the file
+			{
+				parsedFilePosition = fileBeingPrinted->Position();
 				gb->SetFinished(ActOnGcode(gb));
+			}
 			fileBeingPrinted->Close();
 			fileBeingPrinted = NULL;
 		}
@@ -365,17 +378,70 @@ bool GCodes::SetUpMove(GCodeBuffer *gb)
   return true; 
 }
 
+// G2 and G3.  The end point and feedrate are read as for G1, and the centre is given
+// either by I and J, its offset from the start point, or by R, the radius (negative for
+// the longer of the two possible arcs).  Move cuts the arc up into straight lines.
+
+bool GCodes::SetUpArc(GCodeBuffer* gb, bool clockwise)
+{
+  if(moveAvailable)
+    return false;
+
+  if(!reprap.GetMove()->GetCurrentState(moveBuffer))
+    return false;
+
+  float x0 = moveBuffer[X_AXIS];
+  float y0 = moveBuffer[Y_AXIS];
+  LoadMoveBufferFromGCode(gb, false);
+
+  if(gb->Seen('I') || gb->Seen('J'))
+  {
+    arcCentre[0] = x0;
+    arcCentre[1] = y0;
+    if(gb->Seen('I'))
+      arcCentre[0] += gb->GetFValue()*distanceScale;
+    if(gb->Seen('J'))
+      arcCentre[1] += gb->GetFValue()*distanceScale;
+  } else
+  {
+    // The centre is on the perpendicular bisector of the chord, to the
+    // right of it going clockwise for the short arc.
+
+    gb->Seen('R');
+    float r = gb->GetFValue()*distanceScale;
+    float dx = moveBuffer[X_AXIS] - x0;
+    float dy = moveBuffer[Y_AXIS] - y0;
+    float chord2 = dx*dx + dy*dy;
+    float h = 0.0;
+    if(chord2 > 0.0 && 4.0*r*r > chord2)
+      h = sqrt(r*r/chord2 - 0.25);
+    if(clockwise != (r < 0.0))
+      h = -h;
+    arcCentre[0] = x0 + 0.5*dx - h*dy;
+    arcCentre[1] = y0 + 0.5*dy + h*dx;
+  }
+
+  moveArc = clockwise ? clockwiseArc : anticlockwiseArc;
+  checkEndStops = false;
+  moveAvailable = true;
+  return true;
+}
+
 // The Move class calls this function to find what to do next.
 
-bool GCodes::ReadMove(float m[], bool& ce)
+bool GCodes::ReadMove(float m[], bool& ce, int8_t& arc, float centre[])
 {
     if(!moveAvailable)
       return false; 
     for(int8_t i = 0; i <= DRIVES; i++) // 1 more for feedrate
       m[i] = moveBuffer[i];
     ce = checkEndStops;
+    arc = moveArc;
+    centre[0] = arcCentre[0];
+    centre[1] = arcCentre[1];
     moveAvailable = false;
     checkEndStops = false;
+    moveArc = noArc;
     return true;
 }
 
@@ -481,6 +547,26 @@ bool GCodes::DoCannedCycleMove(bool ce)
 	return false;
 }
 
+// This queues a canned move directly behind whatever was queued before it, without
+// waiting for the machine to stop and without saving and restoring the state.  moveBuffer[]
+// must already hold the end point of the previous move (either from a call of
+// AllMovesAreFinishedAndMoveBufferIsLoaded() or from the moves queued since), and the
+// extruder entries must be zero.  Call it until it returns true.
+
+bool GCodes::QueueCannedMove(bool ce)
+{
+	if(moveAvailable) // Has Move taken the last one yet?
+		return false;
+	for(int8_t drive = 0; drive <= DRIVES; drive++)
+	{
+		if(activeDrive[drive])
+			moveBuffer[drive] = moveToDo[drive];
+	}
+	checkEndStops = ce;
+	moveAvailable = true;
+	return true;
+}
+
 // This sets positions.  I.e. it handles G92.
 
 bool GCodes::SetPositions(GCodeBuffer *gb)
@@ -615,65 +701,97 @@ bool GCodes::DoHome()
 }
 
 // This lifts Z a bit, moves to the probe XY coordinates (obtained by a call to GetProbeCoordinates() ),
-// probes the bed height, and records the Z coordinate probed.  If you want to program any general
-// internal canned cycle, this shows how to do it.
+// probes the bed height, and records the Z coordinate probed.  The probing is done in two
+// passes: a fast approach to find the bed, a short retract, then a slow touch that gives the
+// recorded height.  Moves that don't depend on where the probe triggered are queued straight
+// behind each other with QueueCannedMove(), so the only waits are for the two probing moves.
+// On the way out Z is lifted again, and probeMovesChained is set so that the next point
+// can go straight into its XY travel without waiting for that lift to finish.
 
 bool GCodes::DoSingleZProbeAtPoint()
 {
 	float x, y, z;
 
-	reprap.GetMove()->SetIdentityTransform();  // It doesn't matter if these are called repeatedly
-
 	for(int8_t drive = 0; drive <= DRIVES; drive++)
 		activeDrive[drive] = false;
 
 	switch(cannedCycleMoveCount)
 	{
-	case 0:  // This only does anything on the first move; on all the others Z is already there
-		moveToDo[Z_AXIS] = Z_DIVE;
-		activeDrive[Z_AXIS] = true;
-		moveToDo[DRIVES] = platform->HomeFeedRate(Z_AXIS);
-		activeDrive[DRIVES] = true;
-		reprap.GetMove()->SetZProbing(false);
-		if(DoCannedCycleMove(false))
-			cannedCycleMoveCount++;
+	case 0:  // Lift to the diving height, unless the last point left us on the way there
+		if(!probeMovesChained)
+		{
+			reprap.GetMove()->SetIdentityTransform();  // It doesn't matter if this is called repeatedly
+			if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+				return false;
+			moveToDo[Z_AXIS] = Z_DIVE;
+			activeDrive[Z_AXIS] = true;
+			moveToDo[DRIVES] = Z_PROBE_FAST_FACTOR*platform->HomeFeedRate(Z_AXIS);
+			activeDrive[DRIVES] = true;
+			QueueCannedMove(false);
+		}
+		cannedCycleMoveCount++;
 		return false;
 
 	case 1:
-		GetProbeCoordinates(probeCount, moveToDo[X_AXIS], moveToDo[Y_AXIS], moveToDo[Z_AXIS]);
+		if(probingGrid)
+			reprap.GetMove()->GridProbePoint(probeCount, x, y);
+		else
+			GetProbeCoordinates(probeCount, x, y, z);
+		moveToDo[X_AXIS] = x;
+		moveToDo[Y_AXIS] = y;
 		activeDrive[X_AXIS] = true;
 		activeDrive[Y_AXIS] = true;
 		// NB - we don't use the Z value
 		moveToDo[DRIVES] = platform->HomeFeedRate(X_AXIS);
 		activeDrive[DRIVES] = true;
-		reprap.GetMove()->SetZProbing(false);
-		if(DoCannedCycleMove(false))
+		if(QueueCannedMove(false))
 			cannedCycleMoveCount++;
 		return false;
 
-	case 2:
+	case 2:  // Fast approach
 		moveToDo[Z_AXIS] = -2.0*platform->AxisLength(Z_AXIS);
 		activeDrive[Z_AXIS] = true;
-		moveToDo[DRIVES] = platform->HomeFeedRate(Z_AXIS);
+		moveToDo[DRIVES] = Z_PROBE_FAST_FACTOR*platform->HomeFeedRate(Z_AXIS);
 		activeDrive[DRIVES] = true;
 		reprap.GetMove()->SetZProbing(true);
-		if(DoCannedCycleMove(true))
+		if(QueueCannedMove(true))
 			cannedCycleMoveCount++;
 		return false;
 
-	case 3:
-		moveToDo[Z_AXIS] = Z_DIVE;
+	case 3:  // Wait till the probe triggers, then back off from where it did
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			return false;
+		moveToDo[Z_AXIS] = moveBuffer[Z_AXIS] + Z_PROBE_RETRACT;
+		activeDrive[Z_AXIS] = true;
+		moveToDo[DRIVES] = Z_PROBE_FAST_FACTOR*platform->HomeFeedRate(Z_AXIS);
+		activeDrive[DRIVES] = true;
+		QueueCannedMove(false);
+		cannedCycleMoveCount++;
+		return false;
+
+	case 4:  // Slow touch
+		moveToDo[Z_AXIS] = -2.0*platform->AxisLength(Z_AXIS);
 		activeDrive[Z_AXIS] = true;
 		moveToDo[DRIVES] = platform->HomeFeedRate(Z_AXIS);
 		activeDrive[DRIVES] = true;
-		reprap.GetMove()->SetZProbing(false);
-		if(DoCannedCycleMove(false))
+		if(QueueCannedMove(true))
 			cannedCycleMoveCount++;
 		return false;
 
-	default:
+	default:  // Record the height, and lift ready for the next point
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			return false;
+		if(probingGrid)
+			reprap.GetMove()->SetGridHeight(probeCount, reprap.GetMove()->GetLastProbedZ());
+		else
+			reprap.GetMove()->SetZBedProbePoint(probeCount, reprap.GetMove()->GetLastProbedZ());
+		moveToDo[Z_AXIS] = Z_DIVE;
+		activeDrive[Z_AXIS] = true;
+		moveToDo[DRIVES] = Z_PROBE_FAST_FACTOR*platform->HomeFeedRate(Z_AXIS);
+		activeDrive[DRIVES] = true;
+		QueueCannedMove(false);
+		probeMovesChained = true;
 		cannedCycleMoveCount = 0;
-		reprap.GetMove()->SetZBedProbePoint(probeCount, reprap.GetMove()->GetLastProbedZ());
 		return true;
 	}
 }
@@ -712,7 +830,7 @@ bool GCodes::DoSingleZProbe()
 
 bool GCodes::SetSingleZProbeAtAPosition(GCodeBuffer *gb)
 {
-	if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+	if(cannedCycleMoveCount == 0 && !AllMovesAreFinishedAndMoveBufferIsLoaded())
 		return false;
 
 	if(!gb->Seen('P'))
@@ -754,6 +872,7 @@ bool GCodes::SetSingleZProbeAtAPosition(GCodeBuffer *gb)
 		if(DoSingleZProbeAtPoint())
 		{
 			probeCount = 0;
+			probeMovesChained = false;
 			reprap.GetMove()->SetZProbing(false);
 			if(gb->Seen('S'))
 			{
@@ -784,6 +903,7 @@ bool GCodes::DoMultipleZProbe()
 	if(probeCount >= reprap.GetMove()->NumberOfXYProbePoints())
 	{
 		probeCount = 0;
+		probeMovesChained = false;
 		zProbesSet = true;
 		reprap.GetMove()->SetZProbing(false);
 		reprap.GetMove()->SetProbedBedEquation();
@@ -792,6 +912,52 @@ bool GCodes::DoMultipleZProbe()
 	return false;
 }
 
+// This probes every point of the grid set up by M557, then turns on grid
+// compensation.
+
+bool GCodes::DoGridZProbe()
+{
+	if(reprap.GetMove()->NumberOfGridPoints() <= 0)
+	{
+		platform->Message(HOST_MESSAGE, "Grid probing: no grid has been set with M557.\n");
+		return true;
+	}
+
+	probingGrid = true;
+	if(DoSingleZProbeAtPoint())
+		probeCount++;
+	if(probeCount >= reprap.GetMove()->NumberOfGridPoints())
+	{
+		probeCount = 0;
+		probeMovesChained = false;
+		probingGrid = false;
+		reprap.GetMove()->SetZProbing(false);
+		reprap.GetMove()->SetGridCompensation();
+		return true;
+	}
+	return false;
+}
+
+// Set up the bed compensation grid from M557 X<min>:<max> Y<min>:<max> S<spacing>
+
+bool GCodes::SetGrid(GCodeBuffer *gb, char* reply)
+{
+	float xMin, xMax, yMin, yMax;
+	if(!gb->Seen(gCodeLetters[X_AXIS]) || gb->GetFValuePair(xMin, xMax) != 2 ||
+			!gb->Seen(gCodeLetters[Y_AXIS]) || gb->GetFValuePair(yMin, yMax) != 2 || !gb->Seen('S'))
+	{
+		snprintf(reply, STRING_LENGTH, "Grid needs X<min>:<max> Y<min>:<max> S<spacing>");
+		return false;
+	}
+	if(!reprap.GetMove()->SetGrid(xMin, xMax, yMin, yMax, gb->GetFValue()))
+	{
+		snprintf(reply, STRING_LENGTH, "Grid too big or badly formed; the most points is %dx%d", GRID_MAX_X, GRID_MAX_Y);
+		return false;
+	}
+	reprap.GetMove()->PrintGrid(reply);
+	return true;
+}
+
 // This returns the (X, Y) points to probe the bed at probe point count.  When probing,
 // it returns false.  If called after probing has ended it returns true, and the Z coordinate
 // probed is also returned.
@@ -969,10 +1135,10 @@ bool GCodes::SendConfigToLine()
 
 bool GCodes::DoDwell(GCodeBuffer *gb)
 {
-  float dwell;
+  uint64_t dwell;
   
   if(gb->Seen('P'))
-    dwell = 0.001*(float)gb->GetLValue(); // P values are in milliseconds; we need seconds
+    dwell = 1000ull*(uint64_t)gb->GetLValue(); // P values are in milliseconds; we need microseconds
   else
     return true;  // No time given - throw it away
       
@@ -985,7 +1151,7 @@ bool GCodes::DoDwell(GCodeBuffer *gb)
       
   if(dwellWaiting)
   {
-    if(platform->Time() - dwellTime >= 0.0)
+    if(platform->Time() >= dwellTime)
     {
       dwellWaiting = false;
       reprap.GetMove()->ResumeMoving();
@@ -1015,11 +1181,30 @@ bool GCodes::SetOffsets(GCodeBuffer *gb)
       
     if(gb->Seen('S'))
       reprap.GetHeat()->SetActiveTemperature(head, gb->GetFValue());
-    // FIXME - do X, Y and Z
+
+    head--;
+    if(head >= 0 && head < DRIVES - AXES)
+    {
+    	for(int8_t axis = 0; axis < AXES; axis++)
+    		if(gb->Seen(gCodeLetters[axis]))
+    			toolOffsets[head][axis] = gb->GetFValue();
+    	if(head == selectedHead)
+    		return ApplyToolOffset(head);
+    }
   }
   return true;  
 }
 
+// Tell Move where the nozzle of a head is.  Wait till any move GCodes
+// has still to hand over has gone, as that should use the old offset.
+
+bool GCodes::ApplyToolOffset(int8_t head)
+{
+	if(moveAvailable)
+		return false;
+	return reprap.GetMove()->SetToolOffset(toolOffsets[head]);
+}
+
 // Does what it says.
 
 bool GCodes::DisableDrives()
@@ -1207,6 +1392,17 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     case 1: // Ordinary move
       result = SetUpMove(gb);
       break;
+
+    case 2: // Clockwise arc
+    case 3: // Anticlockwise arc
+      if(!gb->Seen('I') && !gb->Seen('J') && !gb->Seen('R'))
+      {
+        error = true;
+        snprintf(reply, STRING_LENGTH, "Arc needs a centre (I and J) or a radius (R): %s", gb->Buffer());
+        break;
+      }
+      result = SetUpArc(gb, code == 2);
+      break;
       
     case 4: // Dwell
       result = DoDwell(gb);
@@ -1253,6 +1449,10 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	result = DoMultipleZProbe();
     	break;
 
+    case 29: // Probe the grid set by M557 and use it to compensate for the bed's shape
+    	result = DoGridZProbe();
+    	break;
+
     case 90: // Absolute coordinates
       drivesRelative = false;
       axesRelative = false;
@@ -1462,6 +1662,16 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     
     case 122:
       reprap.Diagnostics();
+      if(gb->Seen('S'))
+      {
+    	  if(gb->GetIValue() == 1)
+    		  reprap.ResetTimingStatistics();
+      }
+      if(gb->Seen('P'))
+      {
+    	  if(gb->GetIValue() == 1)
+    		  reprap.GetMove()->KinematicsBenchmark(reply);
+      }
       break;
       
     case 126: // Valve open
@@ -1512,6 +1722,11 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	break;
 
     case 205:  //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk
+    	// Only B (in microseconds, as other firmwares take it) is implemented; 0 turns it off
+    	if(gb->Seen('B'))
+    		platform->SetMinSegmentTime(gb->GetFValue()*0.000001);
+    	else
+    		snprintf(reply, STRING_LENGTH, "Minimum segment time: %.0f us", platform->MinSegmentTime()*1000000.0);
     	break;
 
     case 206:  // Offset axes
@@ -1540,6 +1755,56 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	}
     	break;
 
+    case 215: // Set maximum jerks (mm/sec^3); 0 gives trapezoidal acceleration
+    	for(int8_t drive = 0; drive < DRIVES; drive++)
+    	{
+    		if(gb->Seen(gCodeLetters[drive]))
+    		{
+    			value = gb->GetFValue()*distanceScale;
+    			platform->SetJerk(drive, value);
+    		}
+    	}
+    	break;
+
+    case 220: // Set the feedrate override (percent); no S prints it
+    	if(gb->Seen('S'))
+    	{
+    		value = gb->GetFValue();
+    		if(value <= 0.0)
+    		{
+    			error = true;
+    			snprintf(reply, STRING_LENGTH, "Invalid speed factor: %.1f%%", value);
+    			break;
+    		}
+    		reprap.GetMove()->SetSpeedFactor(value*0.01);
+    	} else
+    		snprintf(reply, STRING_LENGTH, "Speed factor: %.1f%%", reprap.GetMove()->SpeedFactor()*100.0);
+    	break;
+
+    case 221: // Set the extrusion override (percent) for extruder D; no S prints it
+    	iValue = 0;
+    	if(gb->Seen('D'))
+    		iValue = gb->GetIValue();
+    	if(iValue < 0 || iValue >= DRIVES - AXES)
+    	{
+    		error = true;
+    		snprintf(reply, STRING_LENGTH, "Invalid extruder number: %d", iValue);
+    		break;
+    	}
+    	if(gb->Seen('S'))
+    	{
+    		value = gb->GetFValue();
+    		if(value <= 0.0)
+    		{
+    			error = true;
+    			snprintf(reply, STRING_LENGTH, "Invalid extrusion factor: %.1f%%", value);
+    			break;
+    		}
+    		reprap.GetMove()->SetExtrusionFactor(iValue, value*0.01);
+    	} else
+    		snprintf(reply, STRING_LENGTH, "Extruder %d extrusion factor: %.1f%%", iValue, reprap.GetMove()->ExtrusionFactor(iValue)*100.0);
+    	break;
+
     case 301: // Set PID values
     	break;
 
@@ -1547,6 +1812,39 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	break;
 
     case 304: // Set thermistor parameters
+    	if(gb->Seen('P'))
+    	{
+    		int8_t heater = gb->GetIValue();
+    		if(heater < 0 || heater >= HEATERS)
+    		{
+    			error = true;
+    			snprintf(reply, STRING_LENGTH, "Invalid heater number: %d", heater);
+    			break;
+    		}
+    		float r25 = platform->GetThermistor25R(heater);
+    		float beta = platform->GetThermistorBeta(heater);
+    		float seriesR = platform->GetThermistorSeriesR(heater);
+    		bool seen = false;
+    		if(gb->Seen('T'))
+    		{
+    			r25 = gb->GetFValue();
+    			seen = true;
+    		}
+    		if(gb->Seen('B'))
+    		{
+    			beta = gb->GetFValue();
+    			seen = true;
+    		}
+    		if(gb->Seen('R'))
+    		{
+    			seriesR = gb->GetFValue();
+    			seen = true;
+    		}
+    		if(seen)
+    			platform->SetThermistorParameters(heater, r25, beta, seriesR);
+    		else
+    			snprintf(reply, STRING_LENGTH, "T:%.1f B:%.1f R:%.1f\n", r25, beta, seriesR);
+    	}
     	break;
 
     case 503: // list variable settings
@@ -1608,7 +1906,7 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	}
     	break;
 
-    case 557: // Set Z probe point coordinates
+    case 557: // Set Z probe point coordinates, or the compensation grid
     	if(gb->Seen('P'))
     	{
     		iValue = gb->GetIValue();
@@ -1616,7 +1914,10 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     			reprap.GetMove()->SetXBedProbePoint(iValue, gb->GetFValue());
     		if(gb->Seen(gCodeLetters[Y_AXIS]))
     		    reprap.GetMove()->SetYBedProbePoint(iValue, gb->GetFValue());
-    	}
+    	} else if(gb->Seen(gCodeLetters[X_AXIS]) || gb->Seen(gCodeLetters[Y_AXIS]))
+    		error = !SetGrid(gb, reply);
+    	else
+    		reprap.GetMove()->PrintGrid(reply);
     	break;
 
     case 558: // Set Z probe type
@@ -1651,6 +1952,51 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	}
     	break;
 
+    case 572: // Set pressure advance (seconds) for extruder D; no S prints it
+    	iValue = 0;
+    	if(gb->Seen('D'))
+    		iValue = gb->GetIValue();
+    	if(iValue < 0 || iValue >= DRIVES - AXES)
+    	{
+    		error = true;
+    		snprintf(reply, STRING_LENGTH, "Invalid extruder number: %d", iValue);
+    		break;
+    	}
+    	if(gb->Seen('S'))
+    		platform->SetPressureAdvance(iValue, gb->GetFValue());
+    	else
+    		snprintf(reply, STRING_LENGTH, "Extruder %d pressure advance: %.3f", iValue, platform->PressureAdvance(iValue));
+    	break;
+
+    case 665: // Set delta geometry: arm length, radius, homed height and segments/second; no parameters prints them
+    	seen = false;
+    	if(gb->Seen('L'))
+    	{
+    		platform->SetDeltaDiagonal(gb->GetFValue()*distanceScale);
+    		seen = true;
+    	}
+    	if(gb->Seen('R'))
+    	{
+    		platform->SetDeltaRadius(gb->GetFValue()*distanceScale);
+    		seen = true;
+    	}
+    	if(gb->Seen('H'))
+    	{
+    		platform->SetDeltaHomedHeight(gb->GetFValue()*distanceScale);
+    		seen = true;
+    	}
+    	if(gb->Seen('S'))
+    	{
+    		platform->SetDeltaSegmentsPerSecond(gb->GetFValue());
+    		seen = true;
+    	}
+    	if(seen)
+    		reprap.GetMove()->GeometryChanged();
+    	else
+    		snprintf(reply, STRING_LENGTH, "%s: L%.3f R%.3f H%.3f S%.0f", MachineKinematics::Name(), platform->DeltaDiagonal(),
+    				platform->DeltaRadius(), platform->DeltaHomedHeight(), platform->DeltaSegmentsPerSecond());
+    	break;
+
 //    case 876: // TEMPORARY - this will go away...
 //    	if(gb->Seen('P'))
 //    	{
@@ -1710,6 +2056,9 @@ bool GCodes::ActOnGcode(GCodeBuffer *gb)
     	return result;
     }
 
+    if(code >= 0 && code < DRIVES - AXES && !ApplyToolOffset(code))
+    	return false;
+
     error = true;
     for(int8_t i = AXES; i < DRIVES; i++)
     {
@@ -1884,6 +2233,32 @@ float GCodeBuffer::GetFValue()
   return result; 
 }
 
+// Get two floats separated by a colon (as in X10:190) after a G Code letter found by
+// a call to Seen().  If there is no colon, both are set to the one value.  Returns
+// the number of values read.
+
+int GCodeBuffer::GetFValuePair(float& a, float& b)
+{
+  if(readPointer < 0)
+  {
+     platform->Message(HOST_MESSAGE, "GCodes: Attempt to read a GCode float pair before a search.\n");
+     a = 0.0;
+     b = 0.0;
+     return 0;
+  }
+  char* end;
+  a = (float)strtod(&gcodeBuffer[readPointer + 1], &end);
+  b = a;
+  int count = 1;
+  if(*end == ':')
+  {
+	  b = (float)strtod(end + 1, 0);
+	  count = 2;
+  }
+  readPointer = -1;
+  return count;
+}
+
 // Get a string after a G Code letter found by a call to Seen().
 // It will be the whole of the rest of the GCode string, so strings
 // should always be the last parameter.
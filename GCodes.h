@@ -26,6 +26,13 @@ Licence: GPL
 
 #define GCODE_LETTERS { 'X', 'Y', 'Z', 'E', 'F' } // The drives and feedrate in a GCode
 
+enum ArcDirection
+{
+	noArc = 0,          // A straight line
+	clockwiseArc = 1,   // G2
+	anticlockwiseArc = 2 // G3
+};
+
 // Small class to hold an individual GCode and provide functions to allow it to be parsed
 
 class GCodeBuffer
@@ -38,6 +45,7 @@ class GCodeBuffer
     float GetFValue();
     int GetIValue();
     long GetLValue();
+    int GetFValuePair(float& a, float& b);
     char* GetUnprecedentedString();
     char* GetString();
     char* Buffer();
@@ -71,11 +79,12 @@ class GCodes
     void Init();
     void Exit();
     bool RunConfigurationGCodes();
-    bool ReadMove(float* m, bool& ce);
+    bool ReadMove(float* m, bool& ce, int8_t& arc, float* centre);
     void QueueFileToPrint(char* fileName);
     bool GetProbeCoordinates(int count, float& x, float& y, float& z);
     char* GetCurrentCoordinates();
     bool PrintingAFile() const;
+    unsigned long FilePosition();
     void Diagnostics();
     bool HaveIncomingData() const;
     
@@ -84,16 +93,20 @@ class GCodes
     void doFilePrint(GCodeBuffer* gb);
     bool AllMovesAreFinishedAndMoveBufferIsLoaded();
     bool DoCannedCycleMove(bool ce);
+    bool QueueCannedMove(bool ce);
     bool DoFileCannedCycles(char* fileName);
     bool FileCannedCyclesReturn();
     bool ActOnGcode(GCodeBuffer* gb);
     bool SetUpMove(GCodeBuffer* gb);
+    bool SetUpArc(GCodeBuffer* gb, bool clockwise);
     bool DoDwell(GCodeBuffer *gb);
     bool DoHome();
     bool DoSingleZProbeAtPoint();
     bool DoSingleZProbe();
     bool SetSingleZProbeAtAPosition(GCodeBuffer *gb);
     bool DoMultipleZProbe();
+    bool DoGridZProbe();
+    bool SetGrid(GCodeBuffer *gb, char* reply);
     bool SetPrintZProbe(GCodeBuffer *gb, char *reply);
     bool SetOffsets(GCodeBuffer *gb);
     bool SetPositions(GCodeBuffer *gb);
@@ -110,12 +123,13 @@ class GCodes
     bool SendConfigToLine();
     void WriteHTMLToFile(char b, GCodeBuffer *gb);
     bool OffsetAxes(GCodeBuffer *gb);
+    bool ApplyToolOffset(int8_t head);
 
     int8_t Heater(int8_t head) const;
     Platform* platform;
     bool active;
     Webserver* webserver;
-    float dwellTime;
+    uint64_t dwellTime;
     bool dwellWaiting;
     GCodeBuffer* webGCode;
     GCodeBuffer* fileGCode;
@@ -123,6 +137,8 @@ class GCodes
     GCodeBuffer* cannedCycleGCode;
     bool moveAvailable;
     float moveBuffer[DRIVES+1]; // Last is feedrate
+    int8_t moveArc;             // An ArcDirection; if not noArc, moveBuffer is the end of an arc...
+    float arcCentre[2];         // ...round this XY point
     bool checkEndStops;
     bool drivesRelative; // All except X, Y and Z
     bool axesRelative;   // X, Y and Z
@@ -139,6 +155,7 @@ class GCodes
 	bool offSetSet;
     float distanceScale;
     FileStore* fileBeingPrinted;
+    volatile unsigned long parsedFilePosition; // Where the last line acted on from it ended
     FileStore* fileToPrint;
     FileStore* fileBeingWritten;
     FileStore* configFile;
@@ -147,6 +164,7 @@ class GCodes
     uint8_t eofStringCounter;
     uint8_t eofStringLength;
     int8_t selectedHead;
+    float toolOffsets[DRIVES - AXES][AXES]; // Set by G10, used when the head is selected
     bool homeX;
     bool homeY;
     bool homeZ;
@@ -156,7 +174,9 @@ class GCodes
     int8_t cannedCycleMoveCount;
     bool cannedCycleMoveQueued;
     bool zProbesSet;
-    float longWait;
+    bool probeMovesChained;
+    bool probingGrid;
+    uint64_t longWait;
 };
 
 //*****************************************************************************************************
@@ -198,6 +218,14 @@ inline bool GCodes::PrintingAFile() const
   return fileBeingPrinted != NULL;
 }
 
+// Safe to call from an interrupt, unlike FileStore::Position(), which could catch
+// the file half way through a read.
+
+inline unsigned long GCodes::FilePosition()
+{
+	return parsedFilePosition;
+}
+
 inline bool GCodes::HaveIncomingData() const
 {
 	return fileBeingPrinted != NULL || webserver->GCodeAvailable() || (platform->GetLine()->Status() & byteAvailable);
@@ -49,8 +49,8 @@ void Heat::Spin()
   if(!active)
     return;
     
-  float t = platform->Time();
-  if(t - lastTime < platform->HeatSampleTime())
+  uint64_t t = platform->Time();
+  if(t - lastTime < platform->HeatSampleTicks())
     return;
   lastTime = t;
   for(int8_t heater=0; heater < HEATERS; heater++)
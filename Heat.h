@@ -72,6 +72,7 @@ class Heat
     void ResetFault(int8_t heater);
     bool AllHeatersAtSetTemperatures();
     void Diagnostics();
+    bool Due();
     
   private:
   
@@ -79,8 +80,8 @@ class Heat
     GCodes* gCodes;
     bool active;
     PID* pids[HEATERS];
-    float lastTime;
-    float longWait;
+    uint64_t lastTime;
+    uint64_t longWait;
 };
 
 
@@ -173,6 +174,13 @@ inline void Heat::ResetFault(int8_t heater)
   pids[heater]->ResetFault();
 }
 
+// Is it time to run the PID loops again?
+
+inline bool Heat::Due()
+{
+  return active && platform->Time() - lastTime >= platform->HeatSampleTicks();
+}
+
 
 
 #endif
@@ -0,0 +1,445 @@
+/****************************************************************************************************
+
+RepRapFirmware - Kinematics
+
+This maps between positions of the axes (X, Y, Z in mm) and positions of the motors (in steps)
+for the different sorts of machine.  Which one is used is fixed when the firmware is compiled
+by KINEMATICS in Platform.h, so the Cartesian case costs no more than it did before there was
+a choice.  The extruder drives are the same for all of them and are not dealt with here.
+
+-----------------------------------------------------------------------------------------------------
+
+Version 0.1
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+enum KinematicsType
+{
+	cartesian = 0,	// One motor per axis
+	coreXY = 1,		// Motor X moves the head along x + y, motor Y along x - y
+	hBot = 2,		// Motor X moves the head along x + y, motor Y along y - x
+	linearDelta = 3	// Motors X, Y and Z move carriages up three vertical towers
+};
+
+/*
+ * Each sort of machine provides:
+ *
+ *   linear          - true if straight lines for the head are straight lines for the motors;
+ *                     if not, Move splits moves into short segments
+ *   motorEndStops   - true if the end stops belong to the motors rather than the axes
+ *   Init()          - work out anything cached from the geometry in Platform
+ *   AxesToMotors()  - the motor positions for a head position
+ *   MotorsToAxes()  - the head position for motor positions
+ *   MotorsToAxis()  - one coordinate of the head position
+ *   SetAxis()       - change one axis coordinate of a set of motor positions, leaving the others
+ *   SetHighStop()   - set the position of a drive that has just hit its high end stop
+ *   StepLength()    - how far the head goes when one motor alone takes a step
+ *   MovementSteps() - split motor steps for a move into horizontal and vertical parts, for
+ *                     deciding if it is an XY or a Z move
+ *   XYSpeedFactor() - fastest X or Y motor speed divided by head speed for a move (motor steps
+ *                     and head distance given), so that the motors' maximum feedrates can be respected
+ *   Name()
+ */
+
+template<int8_t kinematics> class Kinematics
+{
+};
+
+//****************************************************************************************************
+
+template<> class Kinematics<cartesian>
+{
+public:
+
+	static const bool linear = true;
+	static const bool motorEndStops = false;
+
+	static void Init(Platform* p)
+	{
+	}
+
+	static void AxesToMotors(Platform* p, const float axes[], long motors[])
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			motors[axis] = (long)roundf(axes[axis]*p->DriveStepsPerUnit(axis));
+	}
+
+	static void MotorsToAxes(Platform* p, const long motors[], float axes[])
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			axes[axis] = ((float)motors[axis])*p->DriveUnitsPerStep(axis);
+	}
+
+	static float MotorsToAxis(Platform* p, const long motors[], int8_t axis)
+	{
+		return ((float)motors[axis])*p->DriveUnitsPerStep(axis);
+	}
+
+	static void SetAxis(Platform* p, long motors[], int8_t axis, float coord)
+	{
+		motors[axis] = (long)roundf(coord*p->DriveStepsPerUnit(axis));
+	}
+
+	static void SetHighStop(Platform* p, long motors[], int8_t drive)
+	{
+		SetAxis(p, motors, drive, p->AxisLength(drive));
+	}
+
+	static float StepLength(Platform* p, int8_t motor)
+	{
+		return p->DriveUnitsPerStep(motor);
+	}
+
+	static void MovementSteps(const long motorDelta[], long& dxy, long& dz)
+	{
+		dxy = labs(motorDelta[X_AXIS]);
+		if(labs(motorDelta[Y_AXIS]) > dxy)
+			dxy = labs(motorDelta[Y_AXIS]);
+		dz = labs(motorDelta[Z_AXIS]);
+	}
+
+	static float XYSpeedFactor(Platform* p, const long motorDelta[], float distance)
+	{
+		return 1.0;
+	}
+
+	static const char* Name()
+	{
+		return "Cartesian";
+	}
+};
+
+//****************************************************************************************************
+
+// CoreXY and H-bot differ only in the sign of motor Y's contribution.  Both assume the X and Y
+// motors have the same steps/mm.  A step of either motor alone moves the head diagonally by
+// 1/sqrt(2) of a step length; the two diagonals are at right angles, so any combination of X and
+// Y steps moves the head by exactly one step length.
+
+template<> class Kinematics<coreXY>
+{
+public:
+
+	static const bool linear = true;
+	static const bool motorEndStops = false;
+
+	static void Init(Platform* p)
+	{
+	}
+
+	static void AxesToMotors(Platform* p, const float axes[], long motors[])
+	{
+		motors[X_AXIS] = (long)roundf((axes[X_AXIS] + axes[Y_AXIS])*p->DriveStepsPerUnit(X_AXIS));
+		motors[Y_AXIS] = (long)roundf((axes[X_AXIS] - axes[Y_AXIS])*p->DriveStepsPerUnit(Y_AXIS));
+		motors[Z_AXIS] = (long)roundf(axes[Z_AXIS]*p->DriveStepsPerUnit(Z_AXIS));
+	}
+
+	static void MotorsToAxes(Platform* p, const long motors[], float axes[])
+	{
+		float a = ((float)motors[X_AXIS])*p->DriveUnitsPerStep(X_AXIS);
+		float b = ((float)motors[Y_AXIS])*p->DriveUnitsPerStep(Y_AXIS);
+		axes[X_AXIS] = 0.5*(a + b);
+		axes[Y_AXIS] = 0.5*(a - b);
+		axes[Z_AXIS] = ((float)motors[Z_AXIS])*p->DriveUnitsPerStep(Z_AXIS);
+	}
+
+	static float MotorsToAxis(Platform* p, const long motors[], int8_t axis)
+	{
+		if(axis == Z_AXIS)
+			return ((float)motors[Z_AXIS])*p->DriveUnitsPerStep(Z_AXIS);
+		float a = ((float)motors[X_AXIS])*p->DriveUnitsPerStep(X_AXIS);
+		float b = ((float)motors[Y_AXIS])*p->DriveUnitsPerStep(Y_AXIS);
+		if(axis == X_AXIS)
+			return 0.5*(a + b);
+		return 0.5*(a - b);
+	}
+
+	static void SetAxis(Platform* p, long motors[], int8_t axis, float coord)
+	{
+		float axes[AXES];
+		MotorsToAxes(p, motors, axes);
+		axes[axis] = coord;
+		AxesToMotors(p, axes, motors);
+	}
+
+	static void SetHighStop(Platform* p, long motors[], int8_t drive)
+	{
+		SetAxis(p, motors, drive, p->AxisLength(drive));
+	}
+
+	static float StepLength(Platform* p, int8_t motor)
+	{
+		if(motor == Z_AXIS)
+			return p->DriveUnitsPerStep(Z_AXIS);
+		return 0.70710678*p->DriveUnitsPerStep(motor);
+	}
+
+	static void MovementSteps(const long motorDelta[], long& dxy, long& dz)
+	{
+		Kinematics<cartesian>::MovementSteps(motorDelta, dxy, dz);
+	}
+
+	// Head speed is |(a + b, a - b)|/2 for motor speeds a and b.
+
+	static float XYSpeedFactor(Platform* p, const long motorDelta[], float distance)
+	{
+		float a = fabs((float)motorDelta[X_AXIS]);
+		float b = fabs((float)motorDelta[Y_AXIS]);
+		float head = sqrt(0.5*(a*a + b*b));
+		if(head <= 0.0)
+			return 1.0;
+		return fmax(a, b)/head;
+	}
+
+	static const char* Name()
+	{
+		return "CoreXY";
+	}
+};
+
+//****************************************************************************************************
+
+template<> class Kinematics<hBot>
+{
+public:
+
+	static const bool linear = true;
+	static const bool motorEndStops = false;
+
+	static void Init(Platform* p)
+	{
+	}
+
+	static void AxesToMotors(Platform* p, const float axes[], long motors[])
+	{
+		motors[X_AXIS] = (long)roundf((axes[X_AXIS] + axes[Y_AXIS])*p->DriveStepsPerUnit(X_AXIS));
+		motors[Y_AXIS] = (long)roundf((axes[Y_AXIS] - axes[X_AXIS])*p->DriveStepsPerUnit(Y_AXIS));
+		motors[Z_AXIS] = (long)roundf(axes[Z_AXIS]*p->DriveStepsPerUnit(Z_AXIS));
+	}
+
+	static void MotorsToAxes(Platform* p, const long motors[], float axes[])
+	{
+		float a = ((float)motors[X_AXIS])*p->DriveUnitsPerStep(X_AXIS);
+		float b = ((float)motors[Y_AXIS])*p->DriveUnitsPerStep(Y_AXIS);
+		axes[X_AXIS] = 0.5*(a - b);
+		axes[Y_AXIS] = 0.5*(a + b);
+		axes[Z_AXIS] = ((float)motors[Z_AXIS])*p->DriveUnitsPerStep(Z_AXIS);
+	}
+
+	static float MotorsToAxis(Platform* p, const long motors[], int8_t axis)
+	{
+		if(axis == Z_AXIS)
+			return ((float)motors[Z_AXIS])*p->DriveUnitsPerStep(Z_AXIS);
+		float a = ((float)motors[X_AXIS])*p->DriveUnitsPerStep(X_AXIS);
+		float b = ((float)motors[Y_AXIS])*p->DriveUnitsPerStep(Y_AXIS);
+		if(axis == X_AXIS)
+			return 0.5*(a - b);
+		return 0.5*(a + b);
+	}
+
+	static void SetAxis(Platform* p, long motors[], int8_t axis, float coord)
+	{
+		float axes[AXES];
+		MotorsToAxes(p, motors, axes);
+		axes[axis] = coord;
+		AxesToMotors(p, axes, motors);
+	}
+
+	static void SetHighStop(Platform* p, long motors[], int8_t drive)
+	{
+		SetAxis(p, motors, drive, p->AxisLength(drive));
+	}
+
+	static float StepLength(Platform* p, int8_t motor)
+	{
+		return Kinematics<coreXY>::StepLength(p, motor);
+	}
+
+	static void MovementSteps(const long motorDelta[], long& dxy, long& dz)
+	{
+		Kinematics<cartesian>::MovementSteps(motorDelta, dxy, dz);
+	}
+
+	static float XYSpeedFactor(Platform* p, const long motorDelta[], float distance)
+	{
+		return Kinematics<coreXY>::XYSpeedFactor(p, motorDelta, distance);
+	}
+
+	static const char* Name()
+	{
+		return "H-bot";
+	}
+};
+
+//****************************************************************************************************
+
+/*
+ * Linear delta.  Carriage i is at height h[i] on a tower at (towerX[i], towerY[i]), and is joined
+ * to the effector by arms of length L.  Going from the head to the motors is one square root per
+ * tower:
+ *
+ *   h[i] = z + sqrt(L^2 - (x - towerX[i])^2 - (y - towerY[i])^2)
+ *
+ * Going back is finding where three spheres meet.  Taking heights relative to carriage 0, subtracting
+ * sphere 0 from spheres 1 and 2 gives two planes that make x and y linear in z; putting those into
+ * sphere 0 gives a quadratic in z, and the effector is at its lower root.  Everything that depends
+ * only on the towers is worked out by Init(), so what's left is one square root.
+ *
+ * Movement along a straight line is not linear for the carriages, so moves are split into segments
+ * by Move, and the step timing uses the average head distance per step of each segment.  The end
+ * stops are high stops on the towers; each carriage stops when it reaches its own.
+ */
+
+template<> class Kinematics<linearDelta>
+{
+public:
+
+	static const bool linear = false;
+	static const bool motorEndStops = true;
+
+	static void Init(Platform* p)
+	{
+		float r = p->DeltaRadius();
+		towerX[X_AXIS] = -0.8660254*r;  // 210 degrees
+		towerY[X_AXIS] = -0.5*r;
+		towerX[Y_AXIS] = 0.8660254*r;   // 330 degrees
+		towerY[Y_AXIS] = -0.5*r;
+		towerX[Z_AXIS] = 0.0;           // 90 degrees
+		towerY[Z_AXIS] = r;
+		armSquared = p->DeltaDiagonal()*p->DeltaDiagonal();
+		homedCarriageHeight = p->DeltaHomedHeight() + sqrt(armSquared - r*r);
+
+		a1 = towerX[Y_AXIS] - towerX[X_AXIS];
+		b1 = towerY[Y_AXIS] - towerY[X_AXIS];
+		a2 = towerX[Z_AXIS] - towerX[X_AXIS];
+		b2 = towerY[Z_AXIS] - towerY[X_AXIS];
+		float q0 = towerX[X_AXIS]*towerX[X_AXIS] + towerY[X_AXIS]*towerY[X_AXIS];
+		q1 = towerX[Y_AXIS]*towerX[Y_AXIS] + towerY[Y_AXIS]*towerY[Y_AXIS] - q0;
+		q2 = towerX[Z_AXIS]*towerX[Z_AXIS] + towerY[Z_AXIS]*towerY[Z_AXIS] - q0;
+		recipDet = 1.0/(a1*b2 - a2*b1);
+	}
+
+	static void AxesToMotors(Platform* p, const float axes[], long motors[])
+	{
+		for(int8_t tower = 0; tower < AXES; tower++)
+		{
+			float dx = axes[X_AXIS] - towerX[tower];
+			float dy = axes[Y_AXIS] - towerY[tower];
+			float s = armSquared - dx*dx - dy*dy;
+			if(s < 0.0)
+				s = 0.0; // Out of reach - the best we can do is arms horizontal
+			motors[tower] = (long)roundf((axes[Z_AXIS] + sqrt(s))*p->DriveStepsPerUnit(tower));
+		}
+	}
+
+	static void MotorsToAxes(Platform* p, const long motors[], float axes[])
+	{
+		float h0 = ((float)motors[X_AXIS])*p->DriveUnitsPerStep(X_AXIS);
+		float c1 = ((float)motors[Y_AXIS])*p->DriveUnitsPerStep(Y_AXIS) - h0;
+		float c2 = ((float)motors[Z_AXIS])*p->DriveUnitsPerStep(Z_AXIS) - h0;
+
+		// a_i*x + b_i*y + c_i*z' = d_i, where z' = z - h0
+
+		float d1 = 0.5*(q1 + c1*c1);
+		float d2 = 0.5*(q2 + c2*c2);
+
+		// So x = ex + fx*z', y = ey + fy*z'
+
+		float ex = (d1*b2 - d2*b1)*recipDet;
+		float fx = (c2*b1 - c1*b2)*recipDet;
+		float ey = (a1*d2 - a2*d1)*recipDet;
+		float fy = (a2*c1 - a1*c2)*recipDet;
+
+		float gx = ex - towerX[X_AXIS];
+		float gy = ey - towerY[X_AXIS];
+		float qa = fx*fx + fy*fy + 1.0;
+		float qb = fx*gx + fy*gy;   // Half the usual b
+		float qc = gx*gx + gy*gy - armSquared;
+		float disc = qb*qb - qa*qc;
+		if(disc < 0.0)
+			disc = 0.0;
+		float z = -(qb + sqrt(disc))/qa;
+
+		axes[X_AXIS] = ex + fx*z;
+		axes[Y_AXIS] = ey + fy*z;
+		axes[Z_AXIS] = h0 + z;
+	}
+
+	static float MotorsToAxis(Platform* p, const long motors[], int8_t axis)
+	{
+		float axes[AXES];
+		MotorsToAxes(p, motors, axes);
+		return axes[axis];
+	}
+
+	static void SetAxis(Platform* p, long motors[], int8_t axis, float coord)
+	{
+		float axes[AXES];
+		MotorsToAxes(p, motors, axes);
+		axes[axis] = coord;
+		AxesToMotors(p, axes, motors);
+	}
+
+	static void SetHighStop(Platform* p, long motors[], int8_t drive)
+	{
+		motors[drive] = (long)roundf(homedCarriageHeight*p->DriveStepsPerUnit(drive));
+	}
+
+	// Not used for timing deltas - see above.
+
+	static float StepLength(Platform* p, int8_t motor)
+	{
+		return p->DriveUnitsPerStep(motor);
+	}
+
+	// What the carriages have in common is vertical movement; the rest is horizontal.
+
+	static void MovementSteps(const long motorDelta[], long& dxy, long& dz)
+	{
+		long mean = (motorDelta[X_AXIS] + motorDelta[Y_AXIS] + motorDelta[Z_AXIS])/3;
+		dz = labs(mean);
+		dxy = 0;
+		for(int8_t tower = 0; tower < AXES; tower++)
+		{
+			long d = labs(motorDelta[tower] - mean);
+			if(d > dxy)
+				dxy = d;
+		}
+	}
+
+	static float XYSpeedFactor(Platform* p, const long motorDelta[], float distance)
+	{
+		if(distance <= 0.0)
+			return 1.0;
+		float fastest = 0.0;
+		for(int8_t tower = 0; tower < AXES; tower++)
+			fastest = fmax(fastest, fabs((float)motorDelta[tower])*p->DriveUnitsPerStep(tower));
+		return fmax(fastest/distance, 1.0);
+	}
+
+	static const char* Name()
+	{
+		return "Linear delta";
+	}
+
+private:
+
+	static float towerX[AXES];
+	static float towerY[AXES];
+	static float armSquared;
+	static float homedCarriageHeight;
+	static float a1, b1, a2, b2;  // Tower 1 and tower 2 positions relative to tower 0
+	static float q1, q2;          // Differences of the towers' squared distances from the origin
+	static float recipDet;
+};
+
+// The one this machine uses
+
+typedef Kinematics<KINEMATICS> MachineKinematics;
+
+#endif
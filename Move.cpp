@@ -20,6 +20,24 @@ Licence: GPL
 
 #include "RepRapFirmware.h"
 
+// The delta geometry cached by Kinematics<linearDelta>::Init()
+
+float Kinematics<linearDelta>::towerX[AXES];
+float Kinematics<linearDelta>::towerY[AXES];
+float Kinematics<linearDelta>::armSquared;
+float Kinematics<linearDelta>::homedCarriageHeight;
+float Kinematics<linearDelta>::a1;
+float Kinematics<linearDelta>::b1;
+float Kinematics<linearDelta>::a2;
+float Kinematics<linearDelta>::b2;
+float Kinematics<linearDelta>::q1;
+float Kinematics<linearDelta>::q2;
+float Kinematics<linearDelta>::recipDet;
+
+// Indexed by UnderrunStage
+
+static const char* underrunStageNames[] = { "G Code", "segmenting", "look-ahead" };
+
 Move::Move(Platform* p, GCodes* g)
 {
   int8_t i;
@@ -66,6 +84,8 @@ void Move::Init()
   
   for(i = 0; i < DRIVES; i++)
     platform->SetDirection(i, FORWARDS);
+
+  MachineKinematics::Init(platform);
   
   // Empty the rings
   
@@ -91,23 +111,40 @@ void Move::Init()
   for(i = 0; i < DRIVES; i++)
   {
 	  ep[i] = 0;
-	  liveCoordinates[i] = 0.0;
+	  liveEndPoints[i] = 0;
+  }
+
+  speedFactor = 1.0;
+  underruns = 0;
+  underrunsLogged = 0;
+  lastUnderrunLogTime = 0;
+  slowedMoves = 0;
+  for(i = 0; i < DRIVES - AXES; i++)
+  {
+	  extrusionFactors[i] = 1.0;
+	  extruderStepRemainders[i] = 0.0;
+	  extrusionFactorRemainders[i] = 0.0;
   }
 
-  lastMove->Init(ep, platform->HomeFeedRate(Z_AXIS), platform->InstantDv(Z_AXIS), false, zMove);  // Typically Z is the slowest Axis
+  lastMove->Init(ep, platform->HomeFeedRate(Z_AXIS), platform->HomeFeedRate(Z_AXIS), platform->InstantDv(Z_AXIS), false, zMove);  // Typically Z is the slowest Axis
   lastMove->Release();
-  liveCoordinates[DRIVES] = platform->HomeFeedRate(Z_AXIS);
+  liveFeedRate = platform->HomeFeedRate(Z_AXIS);
+
+  for(i = 0; i < DRIVES - AXES; i++)
+	  extruderAdvance[i] = 0;
 
   checkEndStopsOnNextMove = false;
 
   SetStepHypotenuse();
+  DDA::InitDriveStepTable();
 
   currentFeedrate = -1.0;
 
-  SetIdentityTransform();
   tanXY = 0.0;
   tanYZ = 0.0;
   tanXZ = 0.0;
+  for(int8_t axis = 0; axis < AXES; axis++)
+	  toolOffset[axis] = 0.0;
 
   lastZHit = 0.0;
   zProbing = false;
@@ -115,7 +152,7 @@ void Move::Init()
   for(uint8_t point = 0; point < NUMBER_OF_PROBE_POINTS; point++)
   {
 	  xBedProbePoints[point] = (0.3 + 0.6*(float)(point%2))*platform->AxisLength(X_AXIS);
-	  yBedProbePoints[point] = (0.0 + 0.9*(float)(point/2))*platform->AxisLength(Y_AXIS);
+	  yBedProbePoints[point] = (0.0 + 0.9*(float)((point/2)%2))*platform->AxisLength(Y_AXIS);
 	  zBedProbePoints[point] = 0.0;
 	  probePointSet[point] = unset;
   }
@@ -123,7 +160,12 @@ void Move::Init()
   xRectangle = 1.0/(0.8*platform->AxisLength(X_AXIS));
   yRectangle = xRectangle;
 
-  secondDegreeCompensation = false;
+  gridXPoints = 0;
+  gridYPoints = 0;
+  SetIdentityTransform();
+  segmenting = false;
+  segmentSplit = false;
+  arcing = false;
 
   lastTime = platform->Time();
   longWait = lastTime;
@@ -145,48 +187,105 @@ void Move::Spin()
     
   DoLookAhead();
   
-  // If there's space in the DDA ring, and there are completed
-  // moves in the look-ahead ring, transfer them.
+  // Transfer as many completed moves from the look-ahead ring
+  // as there is space for in the DDA ring.
  
-  if(!DDARingFull())
+  while(!DDARingFull())
   {
      LookAhead* nextFromLookAhead = LookAheadRingGet();
-     if(nextFromLookAhead != NULL)
+     if(nextFromLookAhead == NULL)
+       break;
+     if(!DDARingAdd(nextFromLookAhead))
      {
-       if(!DDARingAdd(nextFromLookAhead))
-         platform->Message(HOST_MESSAGE, "Can't add to non-full DDA ring!\n"); // Should never happen...
+       platform->Message(HOST_MESSAGE, "Can't add to non-full DDA ring!\n"); // Should never happen...
+       break;
      }
   }
-  
-  // If we either don't want to, or can't, add to the look-ahead ring, go home.
-  
-  if(addNoMoreMoves || LookAheadRingFull())
+
+  // The step timer stops when it runs out of moves; start it again if there are some.
+
+  if(!DDARingEmpty())
+	  platform->KickStepTimer();
+
+  // Take in several moves (or segments of them) while there's time.
+
+  uint32_t start = platform->CycleCount();
+  for(int8_t i = 0; i < MOVES_PER_SPIN; i++)
   {
-	  platform->ClassReport("Move", longWait);
-	  return;
+	  if(!AddNextMove())
+		  break;
+	  if(platform->CycleCount() - start > (uint32_t)(MOVE_SPIN_TIME*CYCLES_PER_SECOND))
+		  break;
   }
+  platform->ClassReport("Move", longWait);
+}
+
+// Take the next move, or the next piece of one being split up, and put it on the
+// look-ahead ring.  Returns false if there was nothing to take or no room for it.
+
+bool Move::AddNextMove()
+{
+  // If we either don't want to, or can't, add to the look-ahead ring, say so.
+  // A move that has been split into segments is finished off even if
+  // we don't want any more moves.
+  
+  if((addNoMoreMoves && !MoveBeingSplit()) || LookAheadRingFull())
+	  return false;
  
-  // If there's a G Code move available, add it to the look-ahead
+  // If there's a G Code move available, set it up to be split
+  // into segments if need be.  Arcs are first cut into chords, one
+  // at a time, and each chord is treated like a move.
+
+  if(!segmenting)
+  {
+	  if(arcing)
+	  {
+		  NextArcChord(nextMove);
+		  StartSegments(nextMove);
+	  } else
+	  {
+		  int8_t arc;
+		  float centre[2];
+		  if(gCodes->ReadMove(nextMove, checkEndStopsOnNextMove, arc, centre))
+		  {
+			  if(arc != noArc)
+			  {
+				  StartArc(nextMove, centre, arc == clockwiseArc);
+				  NextArcChord(nextMove);
+			  }
+			  StartSegments(nextMove);
+		  }
+	  }
+  }
+
+  // Add the next segment (often the whole move) to the look-ahead
   // ring for processing.
 
-  if(gCodes->ReadMove(nextMove, checkEndStopsOnNextMove))
+  if(segmenting)
   {
+	NextSegment(nextMove);
 	Transform(nextMove);
 
     currentFeedrate = nextMove[DRIVES]; // Might be G1 with just an F field
 
-    for(int8_t drive = 0; drive < DRIVES; drive++)
-    	nextMachineEndPoints[drive] = LookAhead::EndPointToMachine(drive, nextMove[drive]);
+    LookAhead::EndPointsToMachine(nextMove, nextMachineEndPoints);
+
+    // Extruder moves are relative, so rounding each one to whole steps would
+    // drift.  Carry the part of a step left over on to the next one instead.
+
+    for(int8_t drive = AXES; drive < DRIVES; drive++)
+    {
+    	float steps = nextMove[drive]*platform->DriveStepsPerUnit(drive) + extruderStepRemainders[drive - AXES];
+    	nextMachineEndPoints[drive] = (long)roundf(steps);
+    	extruderStepRemainders[drive - AXES] = steps - (float)nextMachineEndPoints[drive];
+    }
 
     int8_t movementType = GetMovementType(lastMove->MachineEndPoints(), nextMachineEndPoints);
 
     // Throw it away if there's no real movement.
     
     if(movementType == noMove)
-    {
-       platform->ClassReport("Move", longWait);
-       return;
-    }
+       return true;
      
     // Real move - record its feedrate with it, not here.
     
@@ -202,18 +301,43 @@ void Move::Spin()
       nextMove[DRIVES] = fmax(nextMove[DRIVES], platform->InstantDv(Z_AXIS));
       
     // Restrict maximum feedrates; assumes xy overrides e overrides z FIXME??
+    // The X and Y maximum feedrates are for the motors, which on some machines
+    // go faster than the head.  The limit is applied after the speed factor, so
+    // it is kept with the move in case the speed factor changes.
     
+    float limit;
     if(movementType & xyMove)
-      nextMove[DRIVES] = fmin(nextMove[DRIVES], platform->MaxFeedrate(X_AXIS));  // Assumes X and Y are equal.  FIXME?
+    {
+      long motorDelta[AXES];
+      for(int8_t axis = 0; axis < AXES; axis++)
+    	  motorDelta[axis] = nextMachineEndPoints[axis] - lastMove->MachineEndPoints()[axis];
+      float distance = 0.0;
+      if(!MachineKinematics::linear)
+      {
+    	  float start[AXES];
+    	  lastMove->MachineToEndPoints(start);
+    	  for(int8_t axis = 0; axis < AXES; axis++)
+    		  distance += (nextMove[axis] - start[axis])*(nextMove[axis] - start[axis]);
+    	  distance = sqrt(distance);
+      }
+      limit = platform->MaxFeedrate(X_AXIS)/MachineKinematics::XYSpeedFactor(platform, motorDelta, distance);  // Assumes X and Y are equal.  FIXME?
+    }
     else if(movementType & eMove)
-      nextMove[DRIVES] = fmin(nextMove[DRIVES], platform->MaxFeedrate(AXES)); // Picks up the value for the first extruder.  FIXME?
+      limit = platform->MaxFeedrate(AXES); // Picks up the value for the first extruder.  FIXME?
     else // Must be z
-      nextMove[DRIVES] = fmin(nextMove[DRIVES], platform->MaxFeedrate(Z_AXIS));
+      limit = platform->MaxFeedrate(Z_AXIS);
     
-    if(!LookAheadRingAdd(nextMachineEndPoints, nextMove[DRIVES], 0.0, checkEndStopsOnNextMove, movementType))
+    if(movementType & xyMove)
+      Throttle(nextMove, limit);
+
+    if(!LookAheadRingAdd(nextMachineEndPoints, nextMove[DRIVES], limit, 0.0, checkEndStopsOnNextMove, movementType))
+    {
       platform->Message(HOST_MESSAGE, "Can't add to non-full look ahead ring!\n"); // Should never happen...
+      return false;
+    }
+    return true;
   }
-  platform->ClassReport("Move", longWait);
+  return false;
 }
 
 // These are the actual numbers we want in the positions, so don't transform them.
@@ -230,6 +354,20 @@ void Move::SetPositions(float move[])
 void Move::Diagnostics() 
 {
   platform->Message(HOST_MESSAGE, "Move Diagnostics:\n");
+  snprintf(scratchString, STRING_LENGTH, " underruns: %ld, moves slowed: %ld\n", underruns, slowedMoves);
+  platform->Message(HOST_MESSAGE, scratchString);
+  long recorded = underruns;
+  long first = recorded - UNDERRUN_LOG_LENGTH;
+  if(first < 0)
+	  first = 0;
+  uint64_t now = platform->Time();
+  for(long u = first; u < recorded; u++)
+  {
+	  Underrun* ur = &underrunLog[u % UNDERRUN_LOG_LENGTH];
+	  snprintf(scratchString, STRING_LENGTH, "  %.3fs: file position %lu, %s late, %s\n", (float)UnderrunTime(ur, now)*0.000001,
+			  ur->filePosition, underrunStageNames[ur->stage], ur->stopped ? "stopped" : "cut off at speed");
+	  platform->Message(HOST_MESSAGE, scratchString);
+  }
 /*  if(active)
     platform->Message(HOST_MESSAGE, " active\n");
   else
@@ -266,16 +404,12 @@ void Move::Diagnostics()
 
 bool Move::GetCurrentState(float m[])
 {
-  if(LookAheadRingFull())
+  if(LookAheadRingFull() || MoveBeingSplit())
     return false;
     
-  for(int8_t i = 0; i < DRIVES; i++)
-  {
-    if(i < AXES)
-      m[i] = lastMove->MachineToEndPoint(i);
-    else
-      m[i] = 0.0;
-  }
+  lastMove->MachineToEndPoints(m);
+  for(int8_t i = AXES; i < DRIVES; i++)
+    m[i] = 0.0;
   if(currentFeedrate >= 0.0)
     m[DRIVES] = currentFeedrate;
   else
@@ -298,26 +432,21 @@ bool Move::GetCurrentState(float m[])
 int8_t Move::GetMovementType(long p0[], long p1[])
 {
   int8_t result = noMove;
-  long dxy = 0;
-  long dz = 0;
-  long d;
+  long dxy, dz;
+  long motorDelta[AXES];
 
   for(int8_t drive = 0; drive < DRIVES; drive++)
   {
 	  if(drive < AXES)
-	  {
-		  d = llabs(p1[drive] - p0[drive]);
-		  if(drive == Z_AXIS)
-			  dz = d;
-		  else if(d > dxy)
-			  dxy = d;
-	  } else
+		  motorDelta[drive] = p1[drive] - p0[drive];
+	  else
 	  {
 		  if( p1[drive] )
 			  result |= eMove;
 	  }
   }
-  dxy *= (long)roundf(platform->DriveStepsPerUnit(Z_AXIS)/platform->DriveStepsPerUnit(X_AXIS));
+  MachineKinematics::MovementSteps(motorDelta, dxy, dz);
+  dxy *= (long)roundf(platform->DriveStepsPerUnit(Z_AXIS)*platform->DriveUnitsPerStep(X_AXIS));
   if(dxy > dz)
 	  result |= xyMove;
   else if(dz)
@@ -343,7 +472,7 @@ void Move::SetStepHypotenuse()
 	    {
 	       if(i & (1<<j))
 	       {
-	          e = 1.0/platform->DriveStepsPerUnit(j);
+	          e = MachineKinematics::StepLength(platform, j);
 	          d += e*e;
 	       }
 	    }
@@ -357,7 +486,7 @@ void Move::SetStepHypotenuse()
 	    {
 	       if(i & (1<<j))
 	       {
-	          e = 1.0/platform->DriveStepsPerUnit(AXES + j);
+	          e = platform->DriveUnitsPerStep(AXES + j);
 	          d += e*e;
 	       }
 	    }
@@ -367,10 +496,49 @@ void Move::SetStepHypotenuse()
 	  // We don't want 0.  If no axes/extruders are moving these should never be used.
 	  // But try to be safe.
 
-	  stepDistances[0] = 1.0/platform->DriveStepsPerUnit(AXES);
+	  stepDistances[0] = platform->DriveUnitsPerStep(AXES);
 	  extruderStepDistances[0] = stepDistances[0];
 }
 
+// Call this when the geometry that the kinematics depend on has been changed.
+
+void Move::GeometryChanged()
+{
+	MachineKinematics::Init(platform);
+	SetStepHypotenuse();
+}
+
+// Time the kinematics by converting points round a circle to motor positions and
+// back.  Going from the head to the motors is what is done for every segment of
+// a delta move, so that gives the most segments a second there's time for.
+
+void Move::KinematicsBenchmark(char* reply)
+{
+	float axes[AXES];
+	long motors[AXES];
+	float radius = 0.25*platform->AxisLength(X_AXIS);
+	uint32_t inverseCycles = 0;
+	uint32_t forwardCycles = 0;
+	for(int i = 0; i < KINEMATICS_BENCHMARK_POINTS; i++)
+	{
+		float angle = 2.0*PI*(float)i/(float)KINEMATICS_BENCHMARK_POINTS;
+		axes[X_AXIS] = radius*cos(angle);
+		axes[Y_AXIS] = radius*sin(angle);
+		axes[Z_AXIS] = 10.0;
+		uint32_t t0 = platform->CycleCount();
+		MachineKinematics::AxesToMotors(platform, axes, motors);
+		uint32_t t1 = platform->CycleCount();
+		MachineKinematics::MotorsToAxes(platform, motors, axes);
+		uint32_t t2 = platform->CycleCount();
+		inverseCycles += t1 - t0;
+		forwardCycles += t2 - t1;
+	}
+	float inverseTime = (float)inverseCycles/(CYCLES_PER_SECOND*(float)KINEMATICS_BENCHMARK_POINTS);
+	float forwardTime = (float)forwardCycles/(CYCLES_PER_SECOND*(float)KINEMATICS_BENCHMARK_POINTS);
+	snprintf(reply, STRING_LENGTH, "%s kinematics: head to motors %.1fus (%.0f segments/s), motors to head %.1fus",
+			MachineKinematics::Name(), inverseTime*TIME_TO_REPRAP, 1.0/inverseTime, forwardTime*TIME_TO_REPRAP);
+}
+
 // Take an item from the look-ahead ring and add it to the DDA ring, if
 // possible.
 
@@ -390,6 +558,40 @@ bool Move::DDARingAdd(LookAhead* lookAhead)
       return false;
     }
 
+    // The extrusion factors are applied here, once, as the move leaves the
+    // look-ahead ring, so a change takes effect within a ring's worth of moves.
+    // The extruder end points are relative.
+
+    long* ep = lookAhead->MachineEndPoints();
+    bool moving = false;
+    for(int8_t drive = AXES; drive < DRIVES; drive++)
+    {
+    	if(extrusionFactors[drive - AXES] != 1.0)
+    	{
+    		float steps = (float)ep[drive]*extrusionFactors[drive - AXES] + extrusionFactorRemainders[drive - AXES];
+    		ep[drive] = (long)roundf(steps);
+    		extrusionFactorRemainders[drive - AXES] = steps - (float)ep[drive];
+    	}
+    	if(ep[drive])
+    		moving = true;
+    }
+
+    // An extruder-only move can scale down to no steps at all.  DDA::Init() would
+    // throw it away but leave the DDA on the ring, so drop it here instead.
+
+    long* previous = lookAhead->Previous()->MachineEndPoints();
+    for(int8_t axis = 0; axis < AXES; axis++)
+    {
+    	if(ep[axis] != previous[axis])
+    		moving = true;
+    }
+    if(!moving)
+    {
+    	lookAhead->Release();
+    	ReleaseDDARingLock();
+    	return true;
+    }
+
     // We don't care about Init()'s return value - that should all have been sorted
     // out by LookAhead.
     
@@ -441,7 +643,7 @@ void Move::DoLookAhead()
   // or both to the maximum that can be achieved because of the requirements of
   // the adjacent moves. 
     
-  if(addNoMoreMoves || !gCodes->HaveIncomingData() || lookAheadRingCount > LOOK_AHEAD)
+  if(NoMoreMovesExpected() || lookAheadRingCount > LOOK_AHEAD)
   { 
     
     // Run up the moves
@@ -531,7 +733,7 @@ void Move::DoLookAhead()
     
     // If we are just doing one isolated move, set its end velocity to InstantDv(Z_AXIS).
     
-    if(addNoMoreMoves || !gCodes->HaveIncomingData())
+    if(NoMoreMovesExpected())
     {
       n1->SetV(platform->InstantDv(Z_AXIS));
       n1->SetProcessed(complete);
@@ -543,41 +745,145 @@ void Move::DoLookAhead()
 
 void Move::Interrupt()
 {
-  // Have we got a live DDA?
-  
-  if(dda == NULL)
-  {
-    // No - see if a new one is available.
-    
-    dda = DDARingGet();    
-    if(dda != NULL)
-      dda->Start(true);  // Yes - got it.  So fire it up.
-    return;   
-  }
-  
-  // We have a DDA.  Has it finished?
+  // Have we got a live DDA?  If so, step it.
   
-  if(dda->Active())
+  if(dda != NULL)
   {
-    // No - it's still live.  Step it and return.
-    
     dda->Step();
-    return;
-  }
+    if(dda->Active())
+      return;
   
-  // Yes - it's finished.  Throw it away so the code above will then find a new one.
+    // It's finished.  Throw it away.  If there isn't another one and we
+    // are in the middle of a file, the queue has run dry.
   
-  dda = NULL;
+    if(DDARingEmpty() && gCodes->PrintingAFile() && !addNoMoreMoves)
+	  RecordUnderrun(dda);
+    dda = NULL;
+  }
+
+  // See if a new one is available.  If so, fire it up straight away; its first step
+  // comes one step interval from now.  If not, stop the timer until Spin() has
+  // something for it.
+    
+  dda = DDARingGet();    
+  if(dda != NULL)
+    dda->Start(true);
+  else
+    platform->StopStepTimer();
 }
 
+// Called from the interrupt when the last DDA has finished with no other to follow it
+// while a file is printing, and nothing has asked for the moves to stop (addNoMoreMoves).
+// So this stop wasn't planned: note which stage upstream should have supplied the next
+// move, and where the file had got to.  LogUnderruns() writes them out later.
 
-bool Move::LookAheadRingAdd(long ep[], float feedRate, float vv, bool ce, int8_t mt)
+void Move::RecordUnderrun(DDA* lastDDA)
+{
+	Underrun* ur = &underrunLog[underruns % UNDERRUN_LOG_LENGTH];
+	ur->micros = micros();
+	ur->filePosition = gCodes->FilePosition();
+	if(lookAheadRingCount > 0)
+		ur->stage = lookAheadLate;
+	else if(MoveBeingSplit())
+		ur->stage = segmentingLate;
+	else
+		ur->stage = gCodesLate;
+	ur->stopped = lastDDA->endVelocity <= lastDDA->instantDv;
+	underruns++;
+}
+
+// Append the underruns recorded since the last call to UNDERRUN_FILE.  This is SD card
+// work, so it is called from the main loop after GCodes has had its turn, and is put
+// off while the move queue needs topping up or if the file was written recently.
+// Records waiting meanwhile stay in underrunLog, which keeps the latest few.
+
+void Move::LogUnderruns()
+{
+	if(underrunsLogged == underruns || Urgent())
+		return;
+	uint64_t now = platform->Time();
+	if(now - lastUnderrunLogTime < (uint64_t)(UNDERRUN_LOG_INTERVAL*TIME_TO_REPRAP))
+		return;
+	lastUnderrunLogTime = now;
+	if(underruns - underrunsLogged > UNDERRUN_LOG_LENGTH) // Some have been overwritten
+		underrunsLogged = underruns - UNDERRUN_LOG_LENGTH;
+
+	FileStore* log = platform->GetFileStore(platform->GetSysDir(), UNDERRUN_FILE, true, true);
+	while(underrunsLogged < underruns)
+	{
+		Underrun* ur = &underrunLog[underrunsLogged % UNDERRUN_LOG_LENGTH];
+		if(log != NULL)
+		{
+			snprintf(scratchString, STRING_LENGTH, "%.3fs: file position %lu, %s late, %s\n", (float)UnderrunTime(ur, now)*0.000001,
+					ur->filePosition, underrunStageNames[ur->stage], ur->stopped ? "stopped" : "cut off at speed");
+			log->Write(scratchString);
+		}
+		underrunsLogged++;
+	}
+	if(log != NULL)
+		log->Close();
+}
+
+// When moves arrive faster than the machine gets through them, the look-ahead and DDA
+// rings can run dry, leaving the machine stopping and starting.  So when they are getting
+// low, stretch short XY moves towards the minimum segment time; the fewer moves are
+// queued, the more they are stretched.  move[] is in transformed coordinates, and its
+// feedrate will have the speed factor applied and be limited to limit later.
+
+void Move::Throttle(float move[], float limit)
+{
+	float minTime = platform->MinSegmentTime();
+	if(minTime <= 0.0 || !gCodes->PrintingAFile())
+		return;
+	int queued = lookAheadRingCount + DDARingCount();
+	if(queued >= LOOK_AHEAD_SLOWDOWN)
+		return;
+	if(queued < 1)
+		queued = 1;
+
+	float start[AXES];
+	lastMove->MachineToEndPoints(start);
+	float distance = 0.0;
+	for(int8_t axis = 0; axis < AXES; axis++)
+		distance += (move[axis] - start[axis])*(move[axis] - start[axis]);
+	distance = sqrt(distance);
+
+	float feedRate = fmin(move[DRIVES]*speedFactor, limit);
+	float time = distance/feedRate;
+	if(time >= minTime)
+		return;
+	time = fmin(time + 2.0*(minTime - time)/(float)queued, minTime); // Never longer than the minimum
+	move[DRIVES] = fmax(distance/(time*speedFactor), platform->InstantDv(X_AXIS)); // Not below the minimum Spin() promoted it to
+	slowedMoves++;
+}
+
+
+// Change the feedrate override.  New moves get it as they are added; the moves
+// still in the look-ahead ring (ones not yet handed to the DDA ring) get their
+// feedrates changed now and are sent back through the look-ahead to recompute
+// their end speeds and re-limit them for acceleration.  The first of them is left
+// complete: its start speed is the end speed of a move the DDA ring already has,
+// so that can't change.
+
+void Move::SetSpeedFactor(float factor)
+{
+	speedFactor = factor;
+	bool replan = gCodes->HaveIncomingData(); // Otherwise they are planned as they are added
+	for(LookAhead* la = lookAheadRingGetPointer; la != lookAheadRingAddPointer; la = la->Next())
+	{
+		la->SetSpeedFactor(factor);
+		if(replan && la != lookAheadRingGetPointer)
+			la->SetProcessed(unprocessed);
+	}
+}
+
+bool Move::LookAheadRingAdd(long ep[], float feedRate, float limit, float vv, bool ce, int8_t mt)
 {
     if(LookAheadRingFull())
       return false;
     if(!(lookAheadRingAddPointer->Processed() & released))
       platform->Message(HOST_MESSAGE, "Attempt to alter a non-released lookahead ring entry!\n"); // Should never happen...
-    lookAheadRingAddPointer->Init(ep, feedRate, vv, ce, mt);
+    lookAheadRingAddPointer->Init(ep, feedRate, limit, vv, ce, mt);
     lastMove = lookAheadRingAddPointer;
     lookAheadRingAddPointer = lookAheadRingAddPointer->Next();
     lookAheadRingCount++;
@@ -611,27 +917,82 @@ void Move::SetIdentityTransform()
 	aY = 0.0;
 	aC = 0.0;
 	secondDegreeCompensation = false;
+	gridCompensation = false;
+	BuildTransform();
 }
 
-
-void Move::Transform(float xyzPoint[])
+// Compile the tool offset, the axis skew and the bed plane into one affine map.
+// In order, a point p becomes
+//
+//   p - toolOffset                       (put the tool's nozzle, not the head, at p)
+//   x += tanXY*y + tanXZ*z, y += tanYZ*z  (skew)
+//   z += aX*x + aY*y + aC                (plane, using the skewed x and y)
+//
+// The inverse is worked out exactly here, once, so InverseTransform() costs
+// the same as Transform().
+
+void Move::BuildTransform()
 {
-	xyzPoint[X_AXIS] = xyzPoint[X_AXIS] + tanXY*xyzPoint[Y_AXIS] + tanXZ*xyzPoint[Z_AXIS];
-	xyzPoint[Y_AXIS] = xyzPoint[Y_AXIS] + tanYZ*xyzPoint[Z_AXIS];
-	if(secondDegreeCompensation)
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + SecondDegreeTransformZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-	else
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + aX*xyzPoint[X_AXIS] + aY*xyzPoint[Y_AXIS] + aC;
-}
+	float m[AXES][AXES];
+	m[X_AXIS][X_AXIS] = 1.0;
+	m[X_AXIS][Y_AXIS] = tanXY;
+	m[X_AXIS][Z_AXIS] = tanXZ;
+	m[Y_AXIS][X_AXIS] = 0.0;
+	m[Y_AXIS][Y_AXIS] = 1.0;
+	m[Y_AXIS][Z_AXIS] = tanYZ;
+	m[Z_AXIS][X_AXIS] = aX;
+	m[Z_AXIS][Y_AXIS] = aX*tanXY + aY;
+	m[Z_AXIS][Z_AXIS] = 1.0 + aX*tanXZ + aY*tanYZ;
+
+	for(int8_t i = 0; i < AXES; i++)
+	{
+		float t = (i == Z_AXIS) ? aC : 0.0;
+		for(int8_t j = 0; j < AXES; j++)
+		{
+			transformMatrix[i][j] = m[i][j];
+			t -= m[i][j]*toolOffset[j];
+		}
+		transformMatrix[i][AXES] = t;
+	}
 
-void Move::InverseTransform(float xyzPoint[])
-{
-	if(secondDegreeCompensation)
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - SecondDegreeTransformZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-	else
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - (aX*xyzPoint[X_AXIS] + aY*xyzPoint[Y_AXIS] + aC);
-	xyzPoint[Y_AXIS] = xyzPoint[Y_AXIS] - tanYZ*xyzPoint[Z_AXIS];
-	xyzPoint[X_AXIS] = xyzPoint[X_AXIS] - (tanXY*xyzPoint[Y_AXIS] + tanXZ*xyzPoint[Z_AXIS]);
+	// Inverse of the 3x3 part by cofactors; the translation follows from it.
+
+	float c[AXES][AXES];
+	for(int8_t i = 0; i < AXES; i++)
+	{
+		int8_t i1 = (i + 1)%AXES;
+		int8_t i2 = (i + 2)%AXES;
+		for(int8_t j = 0; j < AXES; j++)
+		{
+			int8_t j1 = (j + 1)%AXES;
+			int8_t j2 = (j + 2)%AXES;
+			c[j][i] = m[i1][j1]*m[i2][j2] - m[i1][j2]*m[i2][j1];
+		}
+	}
+	float det = m[0][0]*c[0][0] + m[0][1]*c[1][0] + m[0][2]*c[2][0];
+	if(fabs(det) < 1.0e-6)
+	{
+		platform->Message(HOST_MESSAGE, "Bed transform can't be inverted - skew and plane ignored.\n");
+		tanXY = 0.0;
+		tanYZ = 0.0;
+		tanXZ = 0.0;
+		aX = 0.0;
+		aY = 0.0;
+		aC = 0.0;
+		BuildTransform();
+		return;
+	}
+	float recipDet = 1.0/det;
+	for(int8_t i = 0; i < AXES; i++)
+	{
+		float t = 0.0;
+		for(int8_t j = 0; j < AXES; j++)
+		{
+			inverseMatrix[i][j] = c[i][j]*recipDet;
+			t -= inverseMatrix[i][j]*transformMatrix[j][AXES];
+		}
+		inverseMatrix[i][AXES] = t;
+	}
 }
 
 
@@ -658,10 +1019,26 @@ void Move::SetAxisCompensation(int8_t axis, float tangent)
 	default:
 		platform->Message(HOST_MESSAGE, "SetAxisCompensation: dud axis.\n");
 	}
+	BuildTransform();
 	Transform(currentPositions);
 	SetPositions(currentPositions);
 }
 
+// Unlike the bed corrections, a tool change doesn't move the head, so the machine
+// coordinates are kept and it is the user's coordinates that change.  Returns false
+// (call again) while a move is still being split up, as its remaining pieces would
+// otherwise be offset differently from the first.
+
+bool Move::SetToolOffset(const float offset[])
+{
+	if(MoveBeingSplit())
+		return false;
+	for(int8_t axis = 0; axis < AXES; axis++)
+		toolOffset[axis] = offset[axis];
+	BuildTransform();
+	return true;
+}
+
 void Move::SetProbedBedEquation()
 {
 	float currentPositions[DRIVES+1];
@@ -673,6 +1050,7 @@ void Move::SetProbedBedEquation()
 
 	if(NumberOfProbePoints() >= 3)
 	{
+		gridCompensation = false;
 		secondDegreeCompensation = (NumberOfProbePoints() == 4);
 		if(secondDegreeCompensation)
 		{
@@ -691,6 +1069,10 @@ void Move::SetProbedBedEquation()
 			 */
 			xRectangle = 1.0/(xBedProbePoints[3] - xBedProbePoints[0]);
 			yRectangle = 1.0/(yBedProbePoints[1] - yBedProbePoints[0]);
+			aX = 0.0;
+			aY = 0.0;
+			aC = 0.0;
+			BuildTransform();
 			Transform(currentPositions);
 			SetPositions(currentPositions);
 			return;
@@ -701,49 +1083,378 @@ void Move::SetProbedBedEquation()
 		return;
 	}
 
-	float xkj, ykj, zkj;
-	float xlj, ylj, zlj;
-	float a, b, c, d;   // Implicit plane equation - what we need to do a proper job
-
-	xkj = xBedProbePoints[1] - xBedProbePoints[0];
-	ykj = yBedProbePoints[1] - yBedProbePoints[0];
-	zkj = zBedProbePoints[1] - zBedProbePoints[0];
-	xlj = xBedProbePoints[2] - xBedProbePoints[0];
-	ylj = yBedProbePoints[2] - yBedProbePoints[0];
-	zlj = zBedProbePoints[2] - zBedProbePoints[0];
-	a = ykj*zlj - zkj*ylj;
-	b = zkj*xlj - xkj*zlj;
-	c = xkj*ylj - ykj*xlj;
-	d = -(xBedProbePoints[1]*a + yBedProbePoints[1]*b + zBedProbePoints[1]*c);
-	aX = -a/c;
-	aY = -b/c;
-	aC = -d/c;
+	// Fit the points in use afresh each time, so nothing left from earlier
+	// probing gets into the sums.
+
+	LeastSquaresPlane plane;
+	plane.Clear(0.5*platform->AxisLength(X_AXIS), 0.5*platform->AxisLength(Y_AXIS));
+	for(int i = 0; i < NumberOfProbePoints(); i++)
+		plane.Add(xBedProbePoints[i], yBedProbePoints[i], zBedProbePoints[i]);
+	if(!plane.Fit(aX, aY, aC))
+	{
+		platform->Message(HOST_MESSAGE, "Bed probe points are in a straight line - can't fit a plane.\n");
+		SetIdentityTransform();
+		return;
+	}
+	ReportProbeResiduals();
+	BuildTransform();
 	Transform(currentPositions);
 	SetPositions(currentPositions);
 }
 
-// FIXME
-// This function is never normally called.  It is a test to time
-// the interrupt function.  To activate it, uncomment the line that calls
-// this in Platform.ino.
+// Print how far each probe point is from the fitted plane.  Big ones are
+// probably bad readings.
 
-void Move::InterruptTime()
+void Move::ReportProbeResiduals()
 {
-/*  char buffer[50];
-  float a[] = {1.0, 2.0, 3.0, 4.0, 5.0};
-  float b[] = {2.0, 3.0, 4.0, 5.0, 6.0};
-  float u = 50;
-  float v = 50;
-  lookAheadDDA->Init(a, b, u, v);
-  lookAheadDDA->Start(false);
-  float t = platform->Time();
-  for(long i = 0; i < 100000; i++) 
-    lookAheadDDA->Step(false);
-  t = platform->Time() - t;
-  platform->Message(HOST_MESSAGE, "Time for 100000 calls of the interrupt function: ");
-  snprintf(buffer, 50, "%ld", t);
-  platform->Message(HOST_MESSAGE, buffer);
-  platform->Message(HOST_MESSAGE, " microseconds.\n");*/
+	float sumSquares = 0.0;
+	int points = NumberOfProbePoints();
+	for(int i = 0; i < points; i++)
+	{
+		float residual = zBedProbePoints[i] - (aX*xBedProbePoints[i] + aY*yBedProbePoints[i] + aC);
+		sumSquares += residual*residual;
+		snprintf(scratchString, STRING_LENGTH, "Probe point %d: X%.1f Y%.1f Z%.3f, residual %.3f\n", i,
+				xBedProbePoints[i], yBedProbePoints[i], zBedProbePoints[i], residual);
+		platform->Message(HOST_MESSAGE, scratchString);
+	}
+	snprintf(scratchString, STRING_LENGTH, "RMS residual %.3f mm from %d points\n", sqrt(sumSquares/(float)points), points);
+	platform->Message(HOST_MESSAGE, scratchString);
+}
+
+//****************************************************************************************************
+
+// Least-squares plane
+
+void LeastSquaresPlane::Clear(float x0, float y0)
+{
+	xOrigin = x0;
+	yOrigin = y0;
+	n = 0;
+	sx = 0.0;
+	sy = 0.0;
+	sz = 0.0;
+	sxx = 0.0;
+	sxy = 0.0;
+	syy = 0.0;
+	sxz = 0.0;
+	syz = 0.0;
+}
+
+// Solve the normal equations
+//
+//   | sxx sxy sx | |a |   | sxz |
+//   | sxy syy sy | |b | = | syz |
+//   | sx  sy  n  | |c'|   | sz  |
+//
+// by Cramer's rule, then move c' back from the local origin.  Returns
+// false if the points are (nearly) in a line.
+
+bool LeastSquaresPlane::Fit(float& a, float& b, float& c) const
+{
+	if(n < 3)
+		return false;
+	float fn = (float)n;
+	float m00 = syy*fn - sy*sy;
+	float m01 = sxy*fn - sy*sx;
+	float m02 = sxy*sy - syy*sx;
+	float det = sxx*m00 - sxy*m01 + sx*m02;
+	float scale = sxx*syy*fn;
+	if(scale <= 0.0 || fabs(det) < 1.0e-5*scale)
+		return false;
+	float recipDet = 1.0/det;
+	a = (sxz*m00 - sxy*(syz*fn - sy*sz) + sx*(syz*sy - syy*sz))*recipDet;
+	b = (sxx*(syz*fn - sy*sz) - sxz*m01 + sx*(sxy*sz - syz*sx))*recipDet;
+	float cLocal = (sxx*(syy*sz - sy*syz) - sxy*(sxy*sz - sx*syz) + sxz*m02)*recipDet;
+	c = cLocal - a*xOrigin - b*yOrigin;
+	return true;
+}
+
+// Set up the bed compensation grid to cover the given rectangle with points no further apart
+// than spacing.  The spacing is adjusted to fit the rectangle exactly.  Returns false if the
+// grid would be too big.  The grid is not used until it has been probed.
+
+bool Move::SetGrid(float xMin, float xMax, float yMin, float yMax, float spacing)
+{
+	if(spacing <= 0.0 || xMax <= xMin || yMax <= yMin)
+		return false;
+	int nx = (int)ceil((xMax - xMin)/spacing - 0.01) + 1;
+	int ny = (int)ceil((yMax - yMin)/spacing - 0.01) + 1;
+	if(nx < 2 || ny < 2 || nx > GRID_MAX_X || ny > GRID_MAX_Y)
+		return false;
+	gridCompensation = false;
+	gridXPoints = nx;
+	gridYPoints = ny;
+	gridXMin = xMin;
+	gridYMin = yMin;
+	gridXSpacing = (xMax - xMin)/(float)(nx - 1);
+	gridYSpacing = (yMax - yMin)/(float)(ny - 1);
+	gridXRecipSpacing = 1.0/gridXSpacing;
+	gridYRecipSpacing = 1.0/gridYSpacing;
+	for(int i = 0; i < nx*ny; i++)
+		gridHeights[i] = 0.0;
+	return true;
+}
+
+void Move::GridProbePoint(int index, float& x, float& y)
+{
+	int i, j;
+	GridIndices(index, i, j);
+	x = gridXMin + (float)i*gridXSpacing;
+	y = gridYMin + (float)j*gridYSpacing;
+}
+
+void Move::SetGridHeight(int index, float z)
+{
+	if(index < 0 || index >= NumberOfGridPoints())
+	{
+		platform->Message(HOST_MESSAGE, "Grid point index out of range.\n");
+		return;
+	}
+	int i, j;
+	GridIndices(index, i, j);
+	gridHeights[j*gridXPoints + i] = z;
+}
+
+// Work out the interpolant for each cell from its corner heights, and start using the grid.
+
+void Move::SetGridCompensation()
+{
+	float currentPositions[DRIVES+1];
+	if(!GetCurrentState(currentPositions))
+	{
+		platform->Message(HOST_MESSAGE, "Setting bed grid - can't get position!");
+		return;
+	}
+
+	for(int j = 0; j < gridYPoints - 1; j++)
+	{
+		for(int i = 0; i < gridXPoints - 1; i++)
+		{
+			float z00 = gridHeights[j*gridXPoints + i];
+			float z10 = gridHeights[j*gridXPoints + i + 1];
+			float z01 = gridHeights[(j + 1)*gridXPoints + i];
+			float z11 = gridHeights[(j + 1)*gridXPoints + i + 1];
+			float* c = gridCells[j*(gridXPoints - 1) + i];
+			c[0] = z00;
+			c[1] = z10 - z00;
+			c[2] = z01 - z00;
+			c[3] = z11 - z10 - z01 + z00;
+		}
+	}
+	aX = 0.0;
+	aY = 0.0;
+	aC = 0.0;
+	secondDegreeCompensation = false;
+	gridCompensation = true;
+	BuildTransform();
+	Transform(currentPositions);
+	SetPositions(currentPositions);
+}
+
+void Move::PrintGrid(char* reply)
+{
+	if(NumberOfGridPoints() <= 0)
+	{
+		snprintf(reply, STRING_LENGTH, "No grid defined");
+		return;
+	}
+	snprintf(reply, STRING_LENGTH, "Grid X%.1f:%.1f Y%.1f:%.1f, %dx%d points, %s", gridXMin,
+			gridXMin + gridXSpacing*(float)(gridXPoints - 1), gridYMin, gridYMin + gridYSpacing*(float)(gridYPoints - 1),
+			gridXPoints, gridYPoints, gridCompensation ? "in use" : "not in use");
+}
+
+// Take a move from GCodes and get ready to hand it out in segments.  The move is
+// only split if it goes some distance in XY and either grid compensation is on, when
+// it is broken wherever it crosses from one grid cell to the next so that Z can
+// follow the interpolated surface, or the kinematics aren't linear, when it is cut
+// into pieces that each take 1/DeltaSegmentsPerSecond() at the requested feedrate.
+// The start point is the untransformed end of the last move.
+
+void Move::StartSegments(float move[])
+{
+	for(int8_t drive = 0; drive <= DRIVES; drive++)
+		segmentEnd[drive] = move[drive];
+	segmentDone = 0.0;
+	segmentFraction = 1.0;
+	segmentSplit = false;
+	segmenting = true;
+	if(!gridCompensation && MachineKinematics::linear)
+		return;
+
+	float start[DRIVES + 1];
+	lastMove->MachineToEndPoints(start);
+	InverseTransform(start);
+	for(int8_t axis = 0; axis < AXES; axis++)
+		segmentStart[axis] = start[axis];
+
+	float dx = segmentEnd[X_AXIS] - segmentStart[X_AXIS];
+	float dy = segmentEnd[Y_AXIS] - segmentStart[Y_AXIS];
+	float length = sqrt(dx*dx + dy*dy);
+	segmentMinStep = 1.0;
+	if(gridCompensation && length >= 2.0*GRID_MIN_SEGMENT)
+		segmentMinStep = GRID_MIN_SEGMENT/length;
+	if(!MachineKinematics::linear && segmentEnd[DRIVES] > 0.0)
+	{
+		int segments = (int)ceil(length*platform->DeltaSegmentsPerSecond()/segmentEnd[DRIVES]);
+		int maxSegments = (int)(length/DELTA_MIN_SEGMENT);
+		if(segments > maxSegments)
+			segments = maxSegments;
+		if(segments > 1)
+		{
+			segmentFraction = 1.0/(float)segments;
+			segmentMinStep = fmin(segmentMinStep, 0.5*segmentFraction);
+		}
+	}
+	segmentSplit = (segmentMinStep < 1.0);
+}
+
+// The fraction of the move at which it next crosses a grid line in one axis,
+// looking from a little way past the end of the last segment.  1.0 if it doesn't.
+
+float Move::NextGridCrossing(float start, float delta, float done, float gridMin, float recipSpacing, float spacing, int points)
+{
+	if(delta == 0.0)
+		return 1.0;
+	float f = (start + (done + segmentMinStep)*delta - gridMin)*recipSpacing;
+	int line;
+	if(delta > 0.0)
+	{
+		line = (int)floor(f) + 1;
+		if(line < 0)
+			line = 0;
+		if(line > points - 1)
+			return 1.0;
+	} else
+	{
+		line = (int)ceil(f) - 1;
+		if(line > points - 1)
+			line = points - 1;
+		if(line < 0)
+			return 1.0;
+	}
+	float t = (gridMin + (float)line*spacing - start)/delta;
+	if(t > 1.0)
+		return 1.0;
+	return t;
+}
+
+// Put the next segment of the current move in move[].  The extruder amounts are
+// shared out in proportion to the length of the segment.
+
+void Move::NextSegment(float move[])
+{
+	if(!segmentSplit)
+	{
+		for(int8_t drive = 0; drive <= DRIVES; drive++)
+			move[drive] = segmentEnd[drive];
+		segmenting = false;
+		return;
+	}
+
+	float t = segmentDone + segmentFraction;
+	if(gridCompensation)
+	{
+		float tx = NextGridCrossing(segmentStart[X_AXIS], segmentEnd[X_AXIS] - segmentStart[X_AXIS], segmentDone,
+				gridXMin, gridXRecipSpacing, gridXSpacing, gridXPoints);
+		float ty = NextGridCrossing(segmentStart[Y_AXIS], segmentEnd[Y_AXIS] - segmentStart[Y_AXIS], segmentDone,
+				gridYMin, gridYRecipSpacing, gridYSpacing, gridYPoints);
+		t = fmin(t, fmin(tx, ty));
+	}
+	if(1.0 - t < segmentMinStep)
+		t = 1.0;
+
+	if(t >= 1.0)
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			move[axis] = segmentEnd[axis];
+		segmenting = false;
+	} else
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			move[axis] = segmentStart[axis] + t*(segmentEnd[axis] - segmentStart[axis]);
+	}
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		move[drive] = (t - segmentDone)*segmentEnd[drive];
+	move[DRIVES] = segmentEnd[DRIVES];
+	segmentDone = t;
+}
+
+// Get ready to cut an arc from the end of the last move to move[] into chords.
+// The angle swept is measured from the start and end radius vectors; if they are
+// the same the arc is a full circle.  The start radius is used throughout, and
+// the last chord goes exactly to the end point.
+
+void Move::StartArc(float move[], float centre[], bool clockwise)
+{
+	for(int8_t drive = 0; drive <= DRIVES; drive++)
+		arcEnd[drive] = move[drive];
+	arcCentre[0] = centre[0];
+	arcCentre[1] = centre[1];
+
+	float start[DRIVES + 1];
+	lastMove->MachineToEndPoints(start);
+	InverseTransform(start);
+	arcStartZ = start[Z_AXIS];
+	arcRadial[0] = start[X_AXIS] - centre[0];
+	arcRadial[1] = start[Y_AXIS] - centre[1];
+	float endX = move[X_AXIS] - centre[0];
+	float endY = move[Y_AXIS] - centre[1];
+
+	float angle = atan2(arcRadial[0]*endY - arcRadial[1]*endX, arcRadial[0]*endX + arcRadial[1]*endY);
+	if(clockwise)
+	{
+		if(angle >= 0.0)
+			angle -= 2.0*PI;
+	} else
+	{
+		if(angle <= 0.0)
+			angle += 2.0*PI;
+	}
+
+	float radius = sqrt(arcRadial[0]*arcRadial[0] + arcRadial[1]*arcRadial[1]);
+	arcChords = (int)ceil(fabs(angle)*radius/ARC_SEGMENT_LENGTH);
+	if(arcChords < 1)
+		arcChords = 1;
+	arcChord = 0;
+	arcRadius = radius;
+	arcStartAngle = atan2(arcRadial[1], arcRadial[0]);
+	arcAngleStep = angle/(float)arcChords;
+	arcCos = cos(arcAngleStep);
+	arcSin = sin(arcAngleStep);
+	arcing = true;
+}
+
+// Put the end of the next chord of the arc in move[].  Z and the extruders
+// go in proportion to the angle turned.
+
+void Move::NextArcChord(float move[])
+{
+	arcChord++;
+	if(arcChord >= arcChords)
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			move[axis] = arcEnd[axis];
+		arcing = false;
+	} else
+	{
+		if(arcChord%ARC_CORRECTION == 0)
+		{
+			float angle = arcStartAngle + (float)arcChord*arcAngleStep;
+			arcRadial[0] = arcRadius*cos(angle);
+			arcRadial[1] = arcRadius*sin(angle);
+		} else
+		{
+			float x = arcRadial[0];
+			arcRadial[0] = x*arcCos - arcRadial[1]*arcSin;
+			arcRadial[1] = x*arcSin + arcRadial[1]*arcCos;
+		}
+		move[X_AXIS] = arcCentre[0] + arcRadial[0];
+		move[Y_AXIS] = arcCentre[1] + arcRadial[1];
+		move[Z_AXIS] = arcStartZ + (arcEnd[Z_AXIS] - arcStartZ)*(float)arcChord/(float)arcChords;
+	}
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		move[drive] = arcEnd[drive]/(float)arcChords;
+	move[DRIVES] = arcEnd[DRIVES];
 }
 
 //****************************************************************************************************
@@ -811,12 +1522,13 @@ MovementProfile DDA::AccelerationCalculation(float& u, float& v, MovementProfile
 	// At which DDA step should we stop accelerating?  myLookAheadEntry->FeedRate() gives
 	// the desired feedrate.
 
-	float d = 0.5*(myLookAheadEntry->FeedRate()*myLookAheadEntry->FeedRate() - u*u)/acceleration; // d = (v1^2 - v0^2)/2a
+	cruiseVelocity = myLookAheadEntry->FeedRate();
+	float d = RampDistance(u, cruiseVelocity); // d = (v1^2 - v0^2)/2a for a trapezoid
 	stopAStep = (long)roundf((d*totalSteps)/distance);
 
 	// At which DDA step should we start decelerating?
 
-	d = 0.5*(v*v - myLookAheadEntry->FeedRate()*myLookAheadEntry->FeedRate())/acceleration;  // This should be 0 or negative...
+	d = RampDistance(cruiseVelocity, v);  // This should be 0 or negative...
 	startDStep = totalSteps + (long)roundf((d*totalSteps)/distance);
 
 	// If acceleration stop is at or after deceleration start, then the distance moved
@@ -829,32 +1541,84 @@ MovementProfile DDA::AccelerationCalculation(float& u, float& v, MovementProfile
 		// Work out the point at which to stop accelerating and then
 		// immediately start decelerating.
 
-		float dCross = 0.5*(0.5*(v*v - u*u)/acceleration + distance);
+		float dCross;
 
-		if(dCross < 0.0 || dCross > distance)
+		if(jerk <= 0.0)
 		{
-			// With the acceleration available, it is not possible
-			// to satisfy u and v within the distance; reduce u and v
-			// proportionately to get ones that work and flag the fact.
-			// The result is two velocities that can just be accelerated
-			// or decelerated between over the distance to get
-			// from one to the other.
-
-			result = change;
-
-			float k = v/u;
-			u = 2.0*acceleration*distance/(k*k - 1);
-			if(u >= 0.0)
+			dCross = 0.5*(0.5*(v*v - u*u)/acceleration + distance);
+
+			if(dCross < 0.0 || dCross > distance)
+			{
+				// With the acceleration available, it is not possible
+				// to satisfy u and v within the distance; reduce u and v
+				// proportionately to get ones that work and flag the fact.
+				// The result is two velocities that can just be accelerated
+				// or decelerated between over the distance to get
+				// from one to the other.
+
+				result = change;
+
+				float k = v/u;
+				u = 2.0*acceleration*distance/(k*k - 1);
+				if(u >= 0.0)
+				{
+					u = sqrt(u);
+					v = k*u;
+				} else
+				{
+					v = sqrt(-u);
+					u = v/k;
+				}
+
+				dCross = 0.5*(0.5*(v*v - u*u)/acceleration + distance);
+			}
+		} else
+		{
+			// The jerk-limited distances have no closed-form inverse, so bisect.  If even
+			// going straight from u to v doesn't fit, scale them both down as above.
+
+			float lo, hi, mid;
+			if(fabs(RampDistance(u, v)) > distance)
 			{
-				u = sqrt(u);
-				v = k*u;
+				result = change;
+				lo = 0.0;
+				hi = 1.0;
+				for(int8_t i = 0; i < JERK_ITERATIONS; i++)
+				{
+					mid = 0.5*(lo + hi);
+					if(fabs(RampDistance(mid*u, mid*v)) > distance)
+						hi = mid;
+					else
+						lo = mid;
+				}
+				u *= lo;
+				v *= lo;
+				if(u < v)
+				{
+					cruiseVelocity = v;
+					dCross = distance;
+				} else
+				{
+					cruiseVelocity = u;
+					dCross = 0.0;
+				}
 			} else
 			{
-				v = sqrt(-u);
-				u = v/k;
+				// Find the highest peak speed whose speed-up from u and slow-down to v fit
+
+				lo = (u > v) ? u : v;
+				hi = cruiseVelocity;
+				for(int8_t i = 0; i < JERK_ITERATIONS; i++)
+				{
+					mid = 0.5*(lo + hi);
+					if(RampDistance(u, mid) - RampDistance(mid, v) > distance)
+						hi = mid;
+					else
+						lo = mid;
+				}
+				cruiseVelocity = lo;
+				dCross = RampDistance(u, lo);
 			}
-
-			dCross = 0.5*(0.5*(v*v - u*u)/acceleration + distance);
 		}
 
 		// The DDA steps at which acceleration stops and deceleration starts
@@ -871,7 +1635,8 @@ void DDA::SetXYAcceleration() // Slight hack - assumes dY = dX
 {
 	acceleration = platform->Acceleration(X_AXIS);
 	instantDv = platform->InstantDv(X_AXIS);
-	timeStep = 1.0/platform->DriveStepsPerUnit(X_AXIS);
+	jerk = platform->Jerk(X_AXIS);
+	timeStep = platform->DriveUnitsPerStep(X_AXIS);
 }
 
 void DDA::SetEAcceleration(float eDistance)
@@ -886,7 +1651,8 @@ void DDA::SetEAcceleration(float eDistance)
         {
           acceleration = platform->Acceleration(drive);
           instantDv = platform->InstantDv(drive);
-          timeStep = 1.0/platform->DriveStepsPerUnit(drive);
+          jerk = platform->Jerk(drive);
+          timeStep = platform->DriveUnitsPerStep(drive);
         }
       }
     }
@@ -907,6 +1673,9 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
   long* positionNow = myLookAheadEntry->Previous()->MachineEndPoints();
   u = myLookAheadEntry->Previous()->V();
   checkEndStops = myLookAheadEntry->CheckEndStops();
+  float axesTarget[AXES], axesNow[AXES];
+  myLookAheadEntry->MachineToEndPoints(axesTarget);
+  myLookAheadEntry->Previous()->MachineToEndPoints(axesNow);
 
   // How far are we going, both in steps and in mm?
   
@@ -915,13 +1684,18 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
     if(drive < AXES) // XY, Z
     {
       delta[drive] = targetPosition[drive] - positionNow[drive];  //Absolute
-      d = myLookAheadEntry->MachineToEndPoint(drive, delta[drive]);
+      d = axesTarget[drive] - axesNow[drive];
       distance += d*d;
+      if(MachineKinematics::motorEndStops)
+    	  checkStop[drive] = (delta[drive] != 0);
+      else
+    	  checkStop[drive] = (d != 0.0);
     } else
     {  // E
       delta[drive] = targetPosition[drive];  // Relative
       d = myLookAheadEntry->MachineToEndPoint(drive, delta[drive]);
       eDistance += d*d;
+      checkStop[drive] = true;
     }
     
     if(delta[drive] >= 0)
@@ -951,6 +1725,16 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
   counter[0] = -totalSteps/2;
   for(drive = 1; drive < DRIVES; drive++)
     counter[drive] = counter[0];
+
+  // Pick the step routine for the drives that move
+
+  int movingDrives = 0;
+  for(drive = 0; drive < DRIVES; drive++)
+  {
+	  if(delta[drive])
+		  movingDrives |= 1<<drive;
+  }
+  stepDrives = driveStepTable[movingDrives];
   
   // Acceleration and velocity calculations
   
@@ -984,7 +1768,8 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
   {
     acceleration = platform->Acceleration(Z_AXIS);
     instantDv = platform->InstantDv(Z_AXIS);
-    timeStep = 1.0/platform->DriveStepsPerUnit(Z_AXIS);
+    jerk = platform->Jerk(Z_AXIS);
+    timeStep = platform->DriveUnitsPerStep(Z_AXIS);
   } else // Must be extruders only
 	  SetEAcceleration(eDistance);
 
@@ -1019,9 +1804,27 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
 
   result = AccelerationCalculation(u, v, result);
   
-  // The initial velocity
+  // The initial velocity, and the state of any jerk-limited ramps
   
   velocity = u;
+  endVelocity = v;
+  accelNow = 0.0;
+  if(jerk > 0.0)
+	  halfRecipJerk = 0.5/jerk;
+
+  // Pressure advance.  Extruding while the head moves in XY, the extruder is kept
+  // K*(extrusion rate) ahead of where Bresenham would put it, where the extrusion rate
+  // is the velocity (above the speed the machine starts and stops at) times
+  // delta/distance.  That is done by adding or withholding single extruder steps as
+  // the velocity changes.  Retractions (which go backwards), extruder-only moves and
+  // travel moves aren't advanced, and give back any advance left from before; see Start().
+
+  for(drive = AXES; drive < DRIVES; drive++)
+  {
+	  advance[drive - AXES] = 0.0;
+	  if((mt & xyMove) && delta[drive] && directions[drive] == FORWARDS && platform->PressureAdvance(drive - AXES) > 0.0)
+		  advance[drive - AXES] = platform->PressureAdvance(drive - AXES)*(float)delta[drive]/distance;
+  }
   
   // Sanity check
   
@@ -1037,39 +1840,120 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v)
   stepCount = 0;
   
   // timeStep is an axis step distance at this point; divide it by the
-  // velocity to get time.
+  // velocity to get time.  Non-linear kinematics use the average over the
+  // move when any of the axis motors step.
+  
+  stepLength = distance/(float)totalSteps;
+  if(!MachineKinematics::linear && (mt & (xyMove | zMove)))
+	  timeStep = stepLength;
   
   timeStep = timeStep/velocity;
   
   return result;
 }
 
+// The directions were worked out in Init; only the pins that change get
+// written, and only for the drives that move.  The first step is a whole
+// interrupt interval away, which is plenty of direction setup time.
+
 void DDA::Start(bool noTest)
 {
   for(int8_t drive = 0; drive < DRIVES; drive++)
-    platform->SetDirection(drive, directions[drive]);
+  {
+    if(delta[drive])
+    {
+      platform->SetDirection(drive, directions[drive]);
+      platform->Enable(drive);
+    }
+  }
+
+  // Pressure advance is needed if any extruder is advanced on this move, or is still
+  // advanced from the last one.  One that isn't moving winds its advance back.
+
+  advancing = false;
+  for(int8_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+  {
+	  if(advance[extruder] > 0.0 || move->extruderAdvance[extruder] != 0)
+	  {
+		  advancing = true;
+		  if(!delta[AXES + extruder])
+		  {
+			  platform->SetDirection(AXES + extruder, BACKWARDS);
+			  platform->Enable(AXES + extruder);
+		  }
+	  }
+  }
+  if(checkEndStops)
+    platform->ArmEndStops(checkStop, &stepCount);
+  else
+    platform->DisarmEndStops();
   if(noTest)
     platform->SetInterrupt(timeStep); // seconds
   active = true;  
 }
 
-void DDA::Step()
+// A delta carriage has reached its stop.  Stop stepping it, and say if any of
+// the others are still going.
+
+bool DDA::StopDrive(int8_t drive)
 {
-  if(!active)
-    return;
-  
-  if(!move->active)
-	  return;
+  delta[drive] = 0;
+  checkStop[drive] = false;
+  for(int8_t axis = 0; axis < AXES; axis++)
+  {
+    if(delta[axis])
+      return true;
+  }
+  return false;
+}
 
-  uint8_t axesMoving = 0;
-  uint8_t extrudersMoving = 0;
-  
-  for(int8_t drive = 0; drive < DRIVES; drive++)
+// The end stop interrupts have latched one or more stops.  Deal with the ones this
+// move is watching.  This tick's steps for the axes that have stopped are taken out,
+// so the coordinates set here match what the motors have done; a Z probe's height
+// is taken from the step it triggered at.
+
+void DDA::EndStopsTriggered(uint32_t stepPortMasks[])
+{
+  platform->ClearEndStopTrigger();
+  for(int8_t drive = 0; drive < AXES; drive++)
   {
+    if(!checkStop[drive])
+      continue;
+    EndStopHit esh = platform->LatchedEndStop(drive);
+    if(esh == lowHit)
+    {
+      for(int8_t axis = 0; axis < AXES; axis++)
+    	  platform->RemoveStep(axis, stepPortMasks); // The move ends here
+      move->HitLowStop(drive, myLookAheadEntry, this, platform->EndStopStepCount(drive));
+      active = false;
+    }
+    if(esh == highHit)
+    {
+      platform->RemoveStep(drive, stepPortMasks);
+      move->HitHighStop(drive, myLookAheadEntry, this);
+      if(MachineKinematics::motorEndStops)
+      {
+    	  platform->DisarmEndStop(drive);
+    	  if(!StopDrive(drive)) // The other carriages carry on to their own stops
+    		  active = false;
+      } else
+    	  active = false;
+    }
+  }
+}
+
+// One drive's share of a DDA step: Bresenham, and holding back extruder steps for
+// pressure advance.
+
+inline void DDA::StepDrive(int8_t drive, uint32_t stepPortMasks[], long advanceChange[], uint8_t& axesMoving, uint8_t& extrudersMoving)
+{
     counter[drive] += delta[drive];
     if(counter[drive] > 0)
     {
-      platform->Step(drive);
+      if(advancing && drive >= AXES && directions[drive] == FORWARDS && advanceChange[drive - AXES] < 0)
+        move->extruderAdvance[drive - AXES]--; // Slowing down: hold this step back
+      else
+        platform->AddStep(drive, stepPortMasks);
 
       counter[drive] -= totalSteps;
       
@@ -1077,42 +1961,149 @@ void DDA::Step()
         axesMoving |= 1<<drive;
       else
         extrudersMoving |= 1<<(drive - AXES);
-        
-      // Hit anything?
-  
-      if(checkEndStops)
-      {
-        EndStopHit esh = platform->Stopped(drive);
-        if(esh == lowHit)
-        {
-          move->HitLowStop(drive, myLookAheadEntry, this);
-          active = false;
-        }
-        if(esh == highHit)
-        {
-          move->HitHighStop(drive, myLookAheadEntry, this);
-          active = false;
-        }
-      }        
     }
+}
+
+// DriveStepper<drives, 0>::Step() does StepDrive() for each drive whose bit
+// is set in drives.  The recursion and the bit tests are resolved by the compiler,
+// so the drives that aren't moving cost nothing in the step interrupt.
+
+template<int drives, int drive> class DriveStepper
+{
+public:
+	static void Step(DDA* dda, uint32_t stepPortMasks[], long advanceChange[], uint8_t& axesMoving, uint8_t& extrudersMoving)
+	{
+		if(drives & (1<<drive))
+			dda->StepDrive(drive, stepPortMasks, advanceChange, axesMoving, extrudersMoving);
+		DriveStepper<drives, drive + 1>::Step(dda, stepPortMasks, advanceChange, axesMoving, extrudersMoving);
+	}
+};
+
+template<int drives> class DriveStepper<drives, DRIVES>
+{
+public:
+	static void Step(DDA* dda, uint32_t stepPortMasks[], long advanceChange[], uint8_t& axesMoving, uint8_t& extrudersMoving)
+	{
+	}
+};
+
+// Put a DriveStepper in the table for every combination of drives from 0 to drives.
+
+template<int drives> class DriveStepTableFiller
+{
+public:
+	static void Fill(DriveStepFunction table[])
+	{
+		table[drives] = &DriveStepper<drives, 0>::Step;
+		DriveStepTableFiller<drives - 1>::Fill(table);
+	}
+};
+
+template<> class DriveStepTableFiller<-1>
+{
+public:
+	static void Fill(DriveStepFunction table[])
+	{
+	}
+};
+
+DriveStepFunction DDA::driveStepTable[1<<DRIVES];
+
+void DDA::InitDriveStepTable()
+{
+	DriveStepTableFiller<(1<<DRIVES) - 1>::Fill(driveStepTable);
+}
+
+void DDA::Step()
+{
+  if(!active)
+    return;
+  
+  if(!move->active)
+	  return;
+
+  uint8_t axesMoving = 0;
+  uint8_t extrudersMoving = 0;
+  uint32_t stepPortMasks[DRIVES]; // The step pins to raise on each port
+  for(int8_t port = 0; port < platform->StepPortCount(); port++)
+	  stepPortMasks[port] = 0;
+
+  // How far is each extruder's advance from where the current velocity wants it?
+
+  long advanceChange[DRIVES - AXES];
+  if(advancing)
+  {
+	  float advanceVelocity = (velocity > instantDv) ? velocity - instantDv : 0.0; // So none is left at a stop
+	  for(int8_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+		  advanceChange[extruder] = (long)(advance[extruder]*advanceVelocity) - move->extruderAdvance[extruder];
   }
   
+  stepDrives(this, stepPortMasks, advanceChange, axesMoving, extrudersMoving);
+  
+  // Speeding up: put in an extra extruder step.  Giving advance back on a move
+  // that goes backwards or not at all: put in an extra backwards one.
+
+  if(advancing)
+  {
+	  for(int8_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+	  {
+		  if(extrudersMoving & (1<<extruder))
+			  continue; // One step edge per interrupt; otherwise next time
+		  if(advanceChange[extruder] > 0)
+		  {
+			  platform->AddStep(AXES + extruder, stepPortMasks);
+			  move->extruderAdvance[extruder]++;
+		  } else if(advanceChange[extruder] < 0 && !(delta[AXES + extruder] && directions[AXES + extruder] == FORWARDS))
+		  {
+			  platform->AddStep(AXES + extruder, stepPortMasks);
+			  move->extruderAdvance[extruder]--;
+		  }
+	  }
+  }
+
+  // The end stops are latched by their own interrupts, so there's just one flag to look at
+  
+  if(checkEndStops && platform->EndStopTriggered())
+	  EndStopsTriggered(stepPortMasks);
+
+  // All the step edges for this tick together
+
+  platform->StepPorts(stepPortMasks);
+  
   // May have hit a stop, so test active here
   
   if(active) 
   {
     if(axesMoving)
-      timeStep = move->stepDistances[axesMoving]/velocity;
+    {
+      if(MachineKinematics::linear)
+    	  timeStep = move->stepDistances[axesMoving]/velocity;
+      else
+    	  timeStep = stepLength/velocity;
+    }
     else
       timeStep = move->extruderStepDistances[extrudersMoving]/velocity;
       
     // Simple Euler integration to get velocities.
     // Maybe one day do a Runge-Kutta?
   
-    if(stepCount < stopAStep)
-      velocity += acceleration*timeStep;
-    if(stepCount >= startDStep)
-      velocity -= acceleration*timeStep;
+    if(jerk > 0.0)
+    {
+    	// S-curve: the acceleration ramps rather than jumping
+
+    	if(stepCount == startDStep)
+    		accelNow = 0.0;
+    	if(stepCount < stopAStep)
+    		velocity += JerkLimitedAcceleration(cruiseVelocity - velocity)*timeStep;
+    	if(stepCount >= startDStep)
+    		velocity -= JerkLimitedAcceleration(velocity - endVelocity)*timeStep;
+    } else
+    {
+    	if(stepCount < stopAStep)
+    		velocity += acceleration*timeStep;
+    	if(stepCount >= startDStep)
+    		velocity -= acceleration*timeStep;
+    }
     
     // Euler is only approximate.
     
@@ -1124,14 +2115,16 @@ void DDA::Step()
     
     platform->SetInterrupt(timeStep);
   }
+
+  platform->EndStepPulses();
   
   if(!active)
   {
+	long* endPoints = myLookAheadEntry->MachineEndPoints(); // Don't use SetLiveCoordinates because that converts coordinates
 	for(int8_t drive = 0; drive < DRIVES; drive++)
-		move->liveCoordinates[drive] = myLookAheadEntry->MachineToEndPoint(drive); // Don't use SetLiveCoordinates because that applies the transform
-	move->liveCoordinates[DRIVES] = myLookAheadEntry->FeedRate();
+		move->liveEndPoints[drive] = endPoints[drive];
+	move->liveFeedRate = myLookAheadEntry->FeedRate();
     myLookAheadEntry->Release();
-    platform->SetInterrupt(STANDBY_INTERRUPT_RATE);
   }
 }
 
@@ -1144,11 +2137,13 @@ LookAhead::LookAhead(Move* m, Platform* p, LookAhead* n)
   next = n;
 }
 
-void LookAhead::Init(long ep[], float f, float vv, bool ce, int8_t mt)
+void LookAhead::Init(long ep[], float f, float limit, float vv, bool ce, int8_t mt)
 {
   v = vv;
   movementType = mt;
-  feedRate = f;
+  requestedFeedRate = f;
+  feedRateLimit = limit;
+  SetSpeedFactor(move->SpeedFactor());
   for(int8_t i = 0; i < DRIVES; i++)
     endPoint[i] = ep[i];
   
@@ -1186,11 +2181,14 @@ float LookAhead::Cosine()
   float b2 = 0.0;
   float m1;
   float m2;
+  float here[AXES], after[AXES], before[AXES];
+  MachineToEndPoints(here);
+  Next()->MachineToEndPoints(after);
+  Previous()->MachineToEndPoints(before);
   for(int8_t i = 0; i < AXES; i++)
   {
-	m1 = MachineToEndPoint(i);
-    m2 = Next()->MachineToEndPoint(i) - m1;
-    m1 = m1 - Previous()->MachineToEndPoint(i);
+    m2 = after[i] - here[i];
+    m1 = here[i] - before[i];
     a2 += m1*m1;
     b2 += m2*m2;
     cosine += m1*m2;
@@ -1208,7 +2206,7 @@ float LookAhead::Cosine()
 
 float LookAhead::MachineToEndPoint(int8_t drive, long coord)
 {
-	return ((float)coord)/reprap.GetPlatform()->DriveStepsPerUnit(drive);
+	return ((float)coord)*reprap.GetPlatform()->DriveUnitsPerStep(drive);
 }
 
 long LookAhead::EndPointToMachine(int8_t drive, float coord)
@@ -1216,7 +2214,11 @@ long LookAhead::EndPointToMachine(int8_t drive, float coord)
 	return  (long)roundf(coord*reprap.GetPlatform()->DriveStepsPerUnit(drive));
 }
 
+// All the drives at once; the axes go through the machine's kinematics.
 
-
-
-
+void LookAhead::EndPointsToMachine(float coords[], long ep[])
+{
+	MachineKinematics::AxesToMotors(reprap.GetPlatform(), coords, ep);
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		ep[drive] = EndPointToMachine(drive, coords[drive]);
+}
@@ -22,8 +22,16 @@ Licence: GPL
 #define MOVE_H
 
 #define DDA_RING_LENGTH 5
+#define DDA_RING_WATERMARK 2 // Below this many queued DDAs, topping up the ring takes priority over everything else
 #define LOOK_AHEAD_RING_LENGTH 20
 #define LOOK_AHEAD 7
+#define LOOK_AHEAD_SLOWDOWN 10 // Below this many queued moves short moves are slowed so the queue drains gently
+#define UNDERRUN_LOG_LENGTH 8 // The most recent underruns kept for M122
+#define UNDERRUN_LOG_INTERVAL 10.0 // Seconds - the least time between appends to UNDERRUN_FILE
+#define MOVES_PER_SPIN 8 // The most moves or segments Spin() takes in at one go...
+#define MOVE_SPIN_TIME 5.0e-4 // ...or for at most about this long (seconds)
+#define KINEMATICS_BENCHMARK_POINTS 200 // Conversions timed by M122 P1
+#define JERK_ITERATIONS 16 // Bisections to find the peak speed of a jerk-limited move too short to cruise
 
 enum MovementProfile
 {
@@ -52,6 +60,24 @@ enum MovementType
   eMove = 4 
 };
 
+// When the DDA ring runs dry in the middle of a file, which part of
+// the pipeline feeding it was late?
+
+enum UnderrunStage
+{
+	gCodesLate = 0,     // No move from the G Codes
+	segmentingLate = 1, // A move was still being cut into segments or arc chords
+	lookAheadLate = 2   // There were moves waiting in the look-ahead ring
+};
+
+struct Underrun
+{
+	unsigned long micros;       // micros() when it happened
+	unsigned long filePosition; // Where the file being printed had got to then
+	int8_t stage;               // An UnderrunStage
+	bool stopped;               // True if the last move slowed to a stop; false if it was cut off at speed
+};
+
 enum PointCoordinateSet
 {
 	unset = 0,
@@ -60,6 +86,26 @@ enum PointCoordinateSet
 	zSet = 4
 };
 
+// Least-squares fit of the plane z = a*x + b*y + c to a set of points.  Coordinates
+// are taken relative to an origin near the middle of the points to keep the sums
+// well conditioned in single precision.
+
+class LeastSquaresPlane
+{
+public:
+
+	void Clear(float x0, float y0);
+	void Add(float x, float y, float z);
+	int Count() const;
+	bool Fit(float& a, float& b, float& c) const;
+
+private:
+
+	float xOrigin, yOrigin;
+	int n;
+	float sx, sy, sz, sxx, sxy, syy, sxz, syz;
+};
+
 
 class LookAhead
 {  
@@ -70,21 +116,25 @@ public:
 
 protected:
 	LookAhead(Move* m, Platform* p, LookAhead* n);
-	void Init(long ep[], float feedRate, float vv, bool ce, int8_t mt);
+	void Init(long ep[], float feedRate, float limit, float vv, bool ce, int8_t mt);
 	LookAhead* Next();
 	LookAhead* Previous();
 	long* MachineEndPoints();
 	float MachineToEndPoint(int8_t drive);
+	void MachineToEndPoints(float axes[]);
 	static float MachineToEndPoint(int8_t drive, long coord);
 	static long EndPointToMachine(int8_t drive, float coord);
+	static void EndPointsToMachine(float coords[], long ep[]);
 	int8_t GetMovementType();
 	float FeedRate();
 	float V();
 	void SetV(float vv);
 	void SetFeedRate(float f);
+	void SetSpeedFactor(float factor);
 	int8_t Processed();
 	void SetProcessed(MovementState ms);
 	void SetDriveCoordinateAndZeroEndSpeed(float a, int8_t drive);
+	void SetHighStopAndZeroEndSpeed(int8_t drive);
 	bool CheckEndStops();
 	void Release();
 
@@ -94,17 +144,25 @@ private:
 	Platform* platform;
 	LookAhead* next;
 	LookAhead* previous;
-	long endPoint[DRIVES+1];  // Should never use the +1, but safety first
+	long endPoint[DRIVES+1];  // Motor positions in steps.  Should never use the +1, but safety first
 	int8_t movementType;
 	float Cosine();
     bool checkEndStops;
     float cosine;
     float v;        // The feedrate we can actually do
     float feedRate; // The requested feedrate
+    float requestedFeedRate; // ...before the speed factor...
+    float feedRateLimit;     // ...and the machine's maximum
     float instantDv;
     volatile int8_t processed;
 };
 
+// DDA::Step hands the per-drive work to one of these, chosen in DDA::Init for the
+// drives that move.  See DriveStepper in Move.cpp.
+
+class DDA;
+typedef void (*DriveStepFunction)(DDA* dda, uint32_t stepPortMasks[], long advanceChange[], uint8_t& axesMoving, uint8_t& extrudersMoving);
+template<int drives, int drive> class DriveStepper;
 
 class DDA
 {
@@ -112,6 +170,9 @@ public:
 
 	friend class Move;
 	friend class LookAhead;
+	template<int drives, int drive> friend class DriveStepper;
+
+	static void InitDriveStepTable();
 
 protected:
 	DDA(Move* m, Platform* p, DDA* n);
@@ -124,8 +185,14 @@ protected:
 
 private:
 	MovementProfile AccelerationCalculation(float& u, float& v, MovementProfile result);
+	float RampDistance(float from, float to);
+	float JerkLimitedAcceleration(float dv);
 	void SetXYAcceleration();
 	void SetEAcceleration(float eDistance);
+	bool StopDrive(int8_t drive);
+	void EndStopsTriggered(uint32_t stepPortMasks[]);
+	void StepDrive(int8_t drive, uint32_t stepPortMasks[], long advanceChange[], uint8_t& axesMoving, uint8_t& extrudersMoving);
+	static DriveStepFunction driveStepTable[1<<DRIVES]; // Indexed by the moving drives' bits
 	Move* move;
 	Platform* platform;
 	DDA* next;
@@ -133,9 +200,12 @@ private:
 	long counter[DRIVES];
 	long delta[DRIVES];
 	bool directions[DRIVES];
+	bool checkStop[DRIVES];   // Which end stops to look at; for the axes, the ones whose coordinate changes
 	long totalSteps;
-	long stepCount;
+	volatile long stepCount;  // Volatile as the end stop interrupts latch it
+	float stepLength;         // Head distance per step of the fastest drive; used for timing non-linear kinematics
 	bool checkEndStops;
+	DriveStepFunction stepDrives;
     float timeStep;
     float velocity;
     long stopAStep;
@@ -143,6 +213,13 @@ private:
     float distance;
     float acceleration;
     float instantDv;
+    float jerk;               // Rate of change of acceleration; 0 or less for a trapezoidal profile
+    float halfRecipJerk;      // 0.5/jerk
+    float accelNow;           // The current acceleration when jerk limited
+    float cruiseVelocity;     // The peak velocity of the move
+    float endVelocity;        // ...and the velocity it finishes at
+    bool advancing;           // True if any extruder is advanced on this move, or is giving back advance
+    float advance[DRIVES - AXES]; // Steps of advance for each extruder per mm/sec of velocity
     volatile bool active;
 };
 
@@ -160,11 +237,11 @@ class Move
     bool GetCurrentState(float m[]); // takes account of all the rings and delays
     void LiveCoordinates(float m[]); // Just gives the last point at the end of the last DDA
     void Interrupt();
-    void InterruptTime();
+    bool Urgent();
     bool AllMovesAreFinished();
     void ResumeMoving();
     void DoLookAhead();
-    void HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA);
+    void HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA, long hitStep);
     void HitHighStop(int8_t drive, LookAhead* la, DDA* hitDDA);
     void SetPositions(float move[]);
     void SetLiveCoordinates(float coords[]);
@@ -180,15 +257,30 @@ class Move
     bool XYProbeCoordinatesSet(int index);
     void SetZProbing(bool probing);
     void SetProbedBedEquation();
+    void ReportProbeResiduals();
     float SecondDegreeTransformZ(float x, float y);
+    bool SetGrid(float xMin, float xMax, float yMin, float yMax, float spacing);
+    int NumberOfGridPoints();
+    void GridProbePoint(int index, float& x, float& y);
+    void SetGridHeight(int index, float z);
+    void SetGridCompensation();
+    void PrintGrid(char* reply);
     float GetLastProbedZ();
     void SetAxisCompensation(int8_t axis, float tangent);
+    bool SetToolOffset(const float offset[]);
     void SetIdentityTransform();
     void Transform(float move[]);
     void InverseTransform(float move[]);
     void Diagnostics();
-    float ComputeCurrentCoordinate(int8_t drive, LookAhead* la, DDA* runningDDA);
+    void LogUnderruns();
+    float ComputeCurrentCoordinate(int8_t drive, LookAhead* la, DDA* runningDDA, long step);
     void SetStepHypotenuse();
+    void GeometryChanged();
+    void KinematicsBenchmark(char* reply);
+    float SpeedFactor() const;
+    void SetSpeedFactor(float factor);
+    float ExtrusionFactor(int8_t extruder) const;
+    void SetExtrusionFactor(int8_t extruder, float factor);
     
 
     friend class DDA;
@@ -200,15 +292,42 @@ class Move
     bool DDARingEmpty();
     bool NoLiveMovement();
     bool DDARingFull();
+    int8_t DDARingCount();
     bool GetDDARingLock();
     void ReleaseDDARingLock();
     bool LookAheadRingEmpty();
     bool LookAheadRingFull();
-    bool LookAheadRingAdd(long ep[], float feedRate, float vv, bool ce, int8_t movementType);
+    bool LookAheadRingAdd(long ep[], float feedRate, float limit, float vv, bool ce, int8_t movementType);
     LookAhead* LookAheadRingGet();
     int8_t GetMovementType(long sp[], long ep[]);
-
-    float liveCoordinates[DRIVES + 1];
+    bool NoMoreMovesExpected();
+    void GridIndices(int index, int& i, int& j);
+    float GridHeight(float x, float y);
+    void StartSegments(float move[]);
+    void NextSegment(float move[]);
+    void StartArc(float move[], float centre[], bool clockwise);
+    void NextArcChord(float move[]);
+    bool AddNextMove();
+    void Throttle(float move[], float limit);
+    void RecordUnderrun(DDA* lastDDA);
+    uint64_t UnderrunTime(Underrun* ur, uint64_t now);
+    bool MoveBeingSplit();
+    float NextGridCrossing(float start, float delta, float done, float gridMin, float recipSpacing, float spacing, int points);
+    void BuildTransform();
+    float MeshHeight(float x, float y);
+
+    long liveEndPoints[DRIVES];  // Motor positions at the end of the last DDA
+    long extruderAdvance[DRIVES - AXES]; // Pressure advance steps currently pushed into each extruder
+    float speedFactor;                   // M220 feedrate override
+    volatile long underruns;             // Times the DDA ring ran dry while printing a file
+    long underrunsLogged;                // How many of those have been written to UNDERRUN_FILE...
+    uint64_t lastUnderrunLogTime;        // ...and when that was last done
+    Underrun underrunLog[UNDERRUN_LOG_LENGTH]; // The latest, indexed by count modulo the length
+    long slowedMoves;                    // Moves slowed by Throttle()
+    float extrusionFactors[DRIVES - AXES]; // M221 extrusion overrides
+    float extruderStepRemainders[DRIVES - AXES]; // Fractions of a step left by rounding relative extruder moves...
+    float extrusionFactorRemainders[DRIVES - AXES]; // ...and by applying the extrusion factors
+    float liveFeedRate;
     
     Platform* platform;
     GCodes* gCodes;
@@ -224,7 +343,7 @@ class Move
     DDA* lookAheadDDA;
     int lookAheadRingCount;
 
-    float lastTime;
+    uint64_t lastTime;
     bool addNoMoreMoves;
     bool active;
     bool checkEndStopsOnNextMove;
@@ -240,10 +359,58 @@ class Move
     float aX, aY, aC; // Bed plane explicit equation z' = z + aX*x + aY*y + aC
     float tanXY, tanYZ, tanXZ; // 90 degrees + angle gives angle between axes
     float xRectangle, yRectangle;
+    float toolOffset[AXES]; // Where the selected tool's nozzle is relative to the head
+
+    // The axis skew, the bed plane and the tool offset compiled into one affine map,
+    // machine = transformMatrix*(x, y, z, 1), and its exact inverse.  Rebuilt by
+    // BuildTransform() whenever any of them change.  The grid or ruled-surface mesh
+    // height is added to Z after this.
+
+    float transformMatrix[AXES][AXES + 1];
+    float inverseMatrix[AXES][AXES + 1];
     float lastZHit;
     bool zProbing;
     bool secondDegreeCompensation;
-    float longWait;
+
+    // The bed compensation grid.  Heights are stored row by row (Y major).  Each cell's bilinear
+    // interpolant is cached as z = c[0] + c[1]*u + (c[2] + c[3]*u)*v, where u and v run from 0 to 1
+    // across the cell.
+
+    int gridXPoints, gridYPoints;
+    float gridXMin, gridYMin;
+    float gridXSpacing, gridYSpacing;
+    float gridXRecipSpacing, gridYRecipSpacing;
+    float gridHeights[GRID_MAX_X*GRID_MAX_Y];
+    float gridCells[(GRID_MAX_X - 1)*(GRID_MAX_Y - 1)][4];
+    bool gridCompensation;
+
+    // Moves being split into segments at grid cell boundaries.  Positions are untransformed;
+    // the extruder entries of segmentEnd are the relative amounts for the whole move.
+
+    bool segmenting;
+    bool segmentSplit;
+    float segmentStart[AXES];
+    float segmentEnd[DRIVES + 1];
+    float segmentDone;      // Fraction of the move already queued
+    float segmentFraction;  // Fraction of the move in each timed segment for non-linear kinematics; 1 if not
+
+    // A G2/G3 arc being cut into straight chords, each of which then goes through the
+    // segmenter above.  The radius vector is turned from one chord to the next by a fixed
+    // rotation, and worked out afresh every ARC_CORRECTION chords so rounding doesn't build up.
+
+    bool arcing;
+    int arcChords;
+    int arcChord;           // Chords handed out so far
+    float arcCentre[2];
+    float arcRadius;
+    float arcRadial[2];     // The end of the last chord relative to the centre
+    float arcStartAngle;
+    float arcAngleStep;
+    float arcCos, arcSin;   // The rotation by arcAngleStep
+    float arcStartZ;
+    float arcEnd[DRIVES + 1]; // As for segmentEnd
+    float segmentMinStep;   // Fraction of the move that is GRID_MIN_SEGMENT long
+    uint64_t longWait;
 };
 
 //********************************************************************************************************
@@ -273,7 +440,16 @@ inline float LookAhead::MachineToEndPoint(int8_t drive)
 {
 	if(drive >= DRIVES)
 		platform->Message(HOST_MESSAGE, "MachineToEndPoint() called for feedrate!\n");
-	return ((float)(endPoint[drive]))/platform->DriveStepsPerUnit(drive);
+	if(drive < AXES)
+		return MachineKinematics::MotorsToAxis(platform, endPoint, drive);
+	return ((float)(endPoint[drive]))*platform->DriveUnitsPerStep(drive);
+}
+
+// The axis coordinates of the end of this move.
+
+inline void LookAhead::MachineToEndPoints(float axes[])
+{
+	MachineKinematics::MotorsToAxes(platform, endPoint, axes);
 }
 
 
@@ -287,6 +463,11 @@ inline void LookAhead::SetFeedRate(float f)
 	feedRate = f;
 }
 
+inline void LookAhead::SetSpeedFactor(float factor)
+{
+	feedRate = fmin(requestedFeedRate*factor, feedRateLimit);
+}
+
 inline int8_t LookAhead::Processed() 
 {
   return processed;
@@ -310,9 +491,19 @@ inline bool LookAhead::CheckEndStops()
   return checkEndStops;
 }
 
+inline void LookAhead::SetHighStopAndZeroEndSpeed(int8_t drive)
+{
+  MachineKinematics::SetHighStop(platform, endPoint, drive);
+  cosine = 2.0;
+  v = 0.0;
+}
+
 inline void LookAhead::SetDriveCoordinateAndZeroEndSpeed(float a, int8_t drive)
 {
-  endPoint[drive] = EndPointToMachine(drive, a);
+  if(drive < AXES)
+	  MachineKinematics::SetAxis(platform, endPoint, drive, a);
+  else
+	  endPoint[drive] = EndPointToMachine(drive, a);
   cosine = 2.0;
   v = 0.0; 
 }
@@ -344,6 +535,46 @@ inline float DDA::InstantDv()
   return instantDv;
 }
 
+// The distance needed to change speed from one velocity to another.  Trapezoidal profiles
+// take (to^2 - from^2)/2a.  Jerk limited ones ramp the acceleration up and down again
+// symmetrically, so the average velocity is still (from + to)/2, but the change takes
+// longer: dv/a + a/j if there is time to reach full acceleration, 2*sqrt(dv/j) if not.
+// The result is negative for decelerations.
+
+inline float DDA::RampDistance(float from, float to)
+{
+	if(jerk <= 0.0)
+		return 0.5*(to*to - from*from)/acceleration;
+	float dv = fabs(to - from);
+	float t;
+	if(dv*jerk >= acceleration*acceleration)
+		t = dv/acceleration + acceleration/jerk;
+	else
+		t = 2.0*sqrt(dv/jerk);
+	t = 0.5*(from + to)*t;
+	return (to < from) ? -t : t;
+}
+
+// The acceleration to use for the next step of a jerk-limited speed change, where dv is the
+// change still to go.  Ramp it up to the limit, then start ramping it down again when the
+// speed gained while doing so (a^2/2j) would take up what's left.
+
+inline float DDA::JerkLimitedAcceleration(float dv)
+{
+	if(dv <= accelNow*accelNow*halfRecipJerk)
+	{
+		accelNow -= jerk*timeStep;
+		if(accelNow < 0.0)
+			accelNow = 0.0;
+	} else
+	{
+		accelNow += jerk*timeStep;
+		if(accelNow > acceleration)
+			accelNow = acceleration;
+	}
+	return accelNow;
+}
+
 
 //***************************************************************************************
 
@@ -366,6 +597,35 @@ inline bool Move::DDARingFull()
   return ddaRingAddPointer->Next()->Next() == ddaRingGetPointer;
 }
 
+// How many DDAs are waiting to be executed, not counting the live one
+
+inline int8_t Move::DDARingCount()
+{
+  int8_t count = 0;
+  for(DDA* d = ddaRingGetPointer; d != ddaRingAddPointer; d = d->Next())
+    count++;
+  return count;
+}
+
+// micros() wraps; the time since an underrun doesn't, unless it was over an hour ago.
+
+inline uint64_t Move::UnderrunTime(Underrun* ur, uint64_t now)
+{
+	return now - (uint64_t)((unsigned long)now - ur->micros);
+}
+
+// The DDA ring is running low and there is a finished look-ahead
+// entry that could go into it.
+
+inline bool Move::Urgent()
+{
+  if(!active)
+    return false;
+  if(LookAheadRingEmpty() || !(lookAheadRingGetPointer->Processed() & complete))
+    return false;
+  return DDARingCount() < DDA_RING_WATERMARK;
+}
+
 inline bool Move::LookAheadRingEmpty()
 {
   return lookAheadRingCount == 0;
@@ -395,8 +655,10 @@ inline void Move::ReleaseDDARingLock()
 
 inline void Move::LiveCoordinates(float m[])
 {
-	for(int8_t drive = 0; drive <= DRIVES; drive++)
-		m[drive] = liveCoordinates[drive];
+	MachineKinematics::MotorsToAxes(platform, liveEndPoints, m);
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		m[drive] = LookAhead::MachineToEndPoint(drive, liveEndPoints[drive]);
+	m[DRIVES] = liveFeedRate;
 	InverseTransform(m);
 }
 
@@ -406,8 +668,8 @@ inline void Move::LiveCoordinates(float m[])
 
 inline void Move::SetLiveCoordinates(float coords[])
 {
-	for(int8_t drive = 0; drive <= DRIVES; drive++)
-		liveCoordinates[drive] = coords[drive];
+	LookAhead::EndPointsToMachine(coords, liveEndPoints);
+	liveFeedRate = coords[DRIVES];
 }
 
 // To wait until all the current moves in the buffers are
@@ -419,7 +681,41 @@ inline void Move::SetLiveCoordinates(float coords[])
 inline bool Move::AllMovesAreFinished()
 {
   addNoMoreMoves = true;
-  return LookAheadRingEmpty() && NoLiveMovement();
+  return LookAheadRingEmpty() && NoLiveMovement() && !MoveBeingSplit();
+}
+
+inline float Move::SpeedFactor() const
+{
+	return speedFactor;
+}
+
+inline float Move::ExtrusionFactor(int8_t extruder) const
+{
+	return extrusionFactors[extruder];
+}
+
+inline void Move::SetExtrusionFactor(int8_t extruder, float factor)
+{
+	extrusionFactors[extruder] = factor;
+}
+
+// True while a move from GCodes still has pieces that haven't gone into
+// the look-ahead ring.
+
+inline bool Move::MoveBeingSplit()
+{
+  return segmenting || arcing;
+}
+
+// The last move in the look-ahead ring will not be followed by another
+// one soon, so it has to stop at its end.  Remaining segments of a split
+// move count as moves to come.
+
+inline bool Move::NoMoreMovesExpected()
+{
+  if(MoveBeingSplit())
+    return false;
+  return addNoMoreMoves || !gCodes->HaveIncomingData();
 }
 
 inline void Move::ResumeMoving()
@@ -427,6 +723,8 @@ inline void Move::ResumeMoving()
   addNoMoreMoves = false;
 }
 
+// Moving a probe point throws away the height that was probed there.
+
 inline void Move::SetXBedProbePoint(int index, float x)
 {
 	if(index < 0 || index >= NUMBER_OF_PROBE_POINTS)
@@ -434,6 +732,8 @@ inline void Move::SetXBedProbePoint(int index, float x)
 		platform->Message(HOST_MESSAGE, "Z probe point  X index out of range.\n");
 		return;
 	}
+	if(x != xBedProbePoints[index])
+		probePointSet[index] &= ~zSet; // The height was for somewhere else
 	xBedProbePoints[index] = x;
 	probePointSet[index] |= xSet;
 }
@@ -445,6 +745,8 @@ inline void Move::SetYBedProbePoint(int index, float y)
 		platform->Message(HOST_MESSAGE, "Z probe point Y index out of range.\n");
 		return;
 	}
+	if(y != yBedProbePoints[index])
+		probePointSet[index] &= ~zSet; // The height was for somewhere else
 	yBedProbePoints[index] = y;
 	probePointSet[index] |= ySet;
 }
@@ -495,28 +797,27 @@ inline bool Move::XYProbeCoordinatesSet(int index)
 	return (probePointSet[index]  & xSet) &&  (probePointSet[index]  & ySet);
 }
 
+// The probe points in use are the ones from 0 up to the first that isn't set.
+// Fewer than 3 is no use to anyone.
+
 inline int Move::NumberOfProbePoints()
 {
-	if(AllProbeCoordinatesSet(0) && AllProbeCoordinatesSet(1) && AllProbeCoordinatesSet(2))
-	{
-		if(AllProbeCoordinatesSet(3))
-			return 4;
-		else
-			return 3;
-	}
-	return 0;
+	int count = 0;
+	while(count < NUMBER_OF_PROBE_POINTS && AllProbeCoordinatesSet(count))
+		count++;
+	if(count < 3)
+		return 0;
+	return count;
 }
 
 inline int Move::NumberOfXYProbePoints()
 {
-	if(XYProbeCoordinatesSet(0) && XYProbeCoordinatesSet(1) && XYProbeCoordinatesSet(2))
-	{
-		if(XYProbeCoordinatesSet(3))
-			return 4;
-		else
-			return 3;
-	}
-	return 0;
+	int count = 0;
+	while(count < NUMBER_OF_PROBE_POINTS && XYProbeCoordinatesSet(count))
+		count++;
+	if(count < 3)
+		return 0;
+	return count;
 }
 
 /*
@@ -538,18 +839,127 @@ inline float Move::SecondDegreeTransformZ(float x, float y)
 	return (1.0 - x)*(1.0 - y)*zBedProbePoints[0] + x*(1.0 - y)*zBedProbePoints[3] + (1.0 - x)*y*zBedProbePoints[1] + x*y*zBedProbePoints[2];
 }
 
+// The non-affine part of the bed compensation at machine coordinates (x, y).
+
+inline float Move::MeshHeight(float x, float y)
+{
+	if(gridCompensation)
+		return GridHeight(x, y);
+	if(secondDegreeCompensation)
+		return SecondDegreeTransformZ(x, y);
+	return 0.0;
+}
+
+inline void Move::Transform(float xyzPoint[])
+{
+	float x = xyzPoint[X_AXIS];
+	float y = xyzPoint[Y_AXIS];
+	float z = xyzPoint[Z_AXIS];
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		const float* m = transformMatrix[axis];
+		xyzPoint[axis] = m[0]*x + m[1]*y + m[2]*z + m[3];
+	}
+	if(gridCompensation || secondDegreeCompensation)
+		xyzPoint[Z_AXIS] += MeshHeight(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
+}
+
+inline void Move::InverseTransform(float xyzPoint[])
+{
+	float x = xyzPoint[X_AXIS];
+	float y = xyzPoint[Y_AXIS];
+	float z = xyzPoint[Z_AXIS];
+	if(gridCompensation || secondDegreeCompensation)
+		z -= MeshHeight(x, y);
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		const float* m = inverseMatrix[axis];
+		xyzPoint[axis] = m[0]*x + m[1]*y + m[2]*z + m[3];
+	}
+}
+
+
+
+//***************************************************************************************
+
+inline void LeastSquaresPlane::Add(float x, float y, float z)
+{
+	x -= xOrigin;
+	y -= yOrigin;
+	sx += x;
+	sy += y;
+	sz += z;
+	sxx += x*x;
+	sxy += x*y;
+	syy += y*y;
+	sxz += x*z;
+	syz += y*z;
+	n++;
+}
+
+inline int LeastSquaresPlane::Count() const
+{
+	return n;
+}
+
+//***************************************************************************************
+
+inline int Move::NumberOfGridPoints()
+{
+	return gridXPoints*gridYPoints;
+}
 
+// The grid is probed in a zig-zag, so each row starts where the last one finished.
 
-inline void Move::HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA)
+inline void Move::GridIndices(int index, int& i, int& j)
+{
+	j = index/gridXPoints;
+	i = index - j*gridXPoints;
+	if(j & 1)
+		i = gridXPoints - 1 - i;
+}
+
+// Bilinear interpolation in the grid.  Outside the grid the height at the nearest edge is used.
+
+inline float Move::GridHeight(float x, float y)
+{
+	float fx = (x - gridXMin)*gridXRecipSpacing;
+	float fy = (y - gridYMin)*gridYRecipSpacing;
+	if(fx < 0.0)
+		fx = 0.0;
+	if(fx > (float)(gridXPoints - 1))
+		fx = (float)(gridXPoints - 1);
+	if(fy < 0.0)
+		fy = 0.0;
+	if(fy > (float)(gridYPoints - 1))
+		fy = (float)(gridYPoints - 1);
+	int i = (int)fx;
+	if(i > gridXPoints - 2)
+		i = gridXPoints - 2;
+	int j = (int)fy;
+	if(j > gridYPoints - 2)
+		j = gridYPoints - 2;
+	float u = fx - (float)i;
+	float v = fy - (float)j;
+	float* c = gridCells[j*(gridXPoints - 1) + i];
+	return c[0] + c[1]*u + (c[2] + c[3]*u)*v;
+}
+
+// When the end stops are on the motors (deltas) the only low stop is the Z probe.
+// The probe height comes from hitStep, where the probe triggered; the coordinate
+// from the steps actually sent, which may be a few more.
+
+inline void Move::HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA, long hitStep)
 {
 	float hitPoint = 0.0;
+	if(MachineKinematics::motorEndStops)
+		drive = Z_AXIS;
 	if(drive == Z_AXIS)
 	{
 		if(zProbing)
 		{
-			lastZHit = ComputeCurrentCoordinate(drive, la, hitDDA);
-			la->SetDriveCoordinateAndZeroEndSpeed(lastZHit, drive);
-			lastZHit = lastZHit - platform->ZProbeStopHeight();
+			la->SetDriveCoordinateAndZeroEndSpeed(ComputeCurrentCoordinate(drive, la, hitDDA, hitDDA->stepCount), drive);
+			lastZHit = ComputeCurrentCoordinate(drive, la, hitDDA, hitStep) - platform->ZProbeStopHeight();
 			return;
 		} else
 		{
@@ -562,15 +972,18 @@ inline void Move::HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA)
 
 inline void Move::HitHighStop(int8_t drive, LookAhead* la, DDA* hitDDA)
 {
-  la->SetDriveCoordinateAndZeroEndSpeed(platform->AxisLength(drive), drive);
+  if(drive < AXES)
+	  la->SetHighStopAndZeroEndSpeed(drive);
+  else
+	  la->SetDriveCoordinateAndZeroEndSpeed(platform->AxisLength(drive), drive);
 }
 
-inline float Move::ComputeCurrentCoordinate(int8_t drive, LookAhead* la, DDA* runningDDA)
+inline float Move::ComputeCurrentCoordinate(int8_t drive, LookAhead* la, DDA* runningDDA, long step)
 {
 	float previous = la->Previous()->MachineToEndPoint(drive);
 	if(runningDDA->totalSteps <= 0)
 		return previous;
-	return previous + (la->MachineToEndPoint(drive) - previous)*(float)runningDDA->stepCount/(float)runningDDA->totalSteps;
+	return previous + (la->MachineToEndPoint(drive) - previous)*(float)step/(float)runningDDA->totalSteps;
 }
 
 
@@ -27,7 +27,6 @@ Licence: GPL
 void setup()
 {
   reprap.Init();
-  //reprap.GetMove()->InterruptTime();  // Uncomment this line to time the interrupt routine on startup
 }
   
 void loop()
@@ -35,6 +34,15 @@ void loop()
   reprap.Spin();
 }
 
+// attachInterrupt() handlers take no arguments, so there is one of these for each axis.
+
+template<int8_t axis> void EndStopChanged()
+{
+  reprap.GetPlatform()->EndStopInterrupt(axis);
+}
+
+static void (* const endStopHandlers[AXES])() = { EndStopChanged<X_AXIS>, EndStopChanged<Y_AXIS>, EndStopChanged<Z_AXIS> };
+
 //*************************************************************************************************
 
 Platform::Platform()
@@ -92,15 +100,17 @@ void Platform::Init()
   highStopPins = HIGH_STOP_PINS;
   maxFeedrates = MAX_FEEDRATES;
   accelerations = ACCELERATIONS;
+  jerks = JERKS;
   driveStepsPerUnit = DRIVE_STEPS_PER_UNIT;
+  for(int8_t drive = 0; drive < DRIVES; drive++)
+	  unitsPerDriveStep[drive] = 1.0/driveStepsPerUnit[drive];
   instantDvs = INSTANT_DVS;
+  pressureAdvances = PRESSURE_ADVANCES;
+  minSegmentTime = MIN_SEGMENT_TIME;
   potWipes = POT_WIPES;
   senseResistor = SENSE_RESISTOR;
   maxStepperDigipotVoltage = MAX_STEPPER_DIGIPOT_VOLTAGE;
   zProbePin = -1; // Default is to use the switch
-  zProbeCount = 0;
-  zProbeSum = 0;
-  zProbeValue = 0;
   zProbeADValue = Z_PROBE_AD_VALUE;
   zProbeStopHeight = Z_PROBE_STOP_HEIGHT;
 
@@ -109,6 +119,10 @@ void Platform::Init()
   axisLengths = AXIS_LENGTHS;
   homeFeedrates = HOME_FEEDRATES;
   headOffsets = HEAD_OFFSETS;
+  deltaDiagonal = DELTA_DIAGONAL_ROD;
+  deltaRadius = DELTA_RADIUS;
+  deltaHomedHeight = DELTA_HOMED_HEIGHT;
+  deltaSegmentsPerSecond = DELTA_SEGMENTS_PER_SECOND;
 
   // HEATERS - Bed is assumed to be the first
 
@@ -116,7 +130,7 @@ void Platform::Init()
   heatOnPins = HEAT_ON_PINS;
   thermistorBetas = THERMISTOR_BETAS;
   thermistorSeriesRs = THERMISTOR_SERIES_RS;
-  thermistorInfRs = THERMISTOR_25_RS;
+  thermistor25Rs = THERMISTOR_25_RS;
   usePID = USE_PID;
   pidKis = PID_KIS;
   pidKds = PID_KDS;
@@ -126,6 +140,7 @@ void Platform::Init()
   pidMax = PID_MAX;
   dMix = D_MIX;
   heatSampleTime = HEAT_SAMPLE_TIME;
+  heatSampleTicks = (uint64_t)(TIME_TO_REPRAP*heatSampleTime);
   standbyTemperatures = STANDBY_TEMPERATURES;
   activeTemperatures = ACTIVE_TEMPERATURES;
   coolingFanPin = COOLING_FAN_PIN;
@@ -135,6 +150,8 @@ void Platform::Init()
   gcodeDir = GCODE_DIR;
   tempDir = TEMP_DIR;
 
+  stepPortCount = 0;
+  stepPulseStart = 0;
   for(i = 0; i < DRIVES; i++)
   {
 
@@ -159,35 +176,53 @@ void Platform::Init()
 		  else
 			  pinMode(enablePins[i], OUTPUT);
 	  }
+	  Pio* stepPort;
+	  PinPortAndMask(stepPins[i], i > Z_AXIS, stepPort, stepMasks[i]);
+	  AddStepPort(i, stepPort);
+	  PinPortAndMask(directionPins[i], i > Z_AXIS, directionPorts[i], directionMasks[i]);
+	  PinPortAndMask(enablePins[i], i >= Z_AXIS, enablePorts[i], enableMasks[i]);
+	  WritePin(stepPort, stepMasks[i], false);
+	  WritePin(directionPorts[i], directionMasks[i], FORWARDS);
+	  driveDirections[i] = FORWARDS;
 	  Disable(i);
 	  driveEnabled[i] = false;
   }
 
+  endStopTriggered = false;
+  endStopStepCounter = NULL;
   for(i = 0; i < AXES; i++)
   {
+	  endStopWatched[i] = false;
+	  endStopLatches[i] = noStop;
+	  endStopStepCounts[i] = 0;
+	  PinPortAndMask(lowStopPins[i], false, lowStopPorts[i], lowStopMasks[i]);
+	  PinPortAndMask(highStopPins[i], false, highStopPorts[i], highStopMasks[i]);
 	  if(lowStopPins[i] >= 0)
 	  {
 		  pinMode(lowStopPins[i], INPUT);
 		  digitalWrite(lowStopPins[i], HIGH); // Turn on pullup
+		  attachInterrupt(lowStopPins[i], endStopHandlers[i], CHANGE);
 	  }
 	  if(highStopPins[i] >= 0)
 	  {
 		  pinMode(highStopPins[i], INPUT);
 		  digitalWrite(highStopPins[i], HIGH); // Turn on pullup
+		  attachInterrupt(highStopPins[i], endStopHandlers[i], CHANGE);
 	  }
   }  
   
   if(heatOnPins[0] >= 0)
         pinMode(heatOnPins[0], OUTPUT);
-  thermistorInfRs[0] = ( thermistorInfRs[0]*exp(-thermistorBetas[0]/(25.0 - ABS_ZERO)) );
   
   for(i = 1; i < HEATERS; i++)
   {
     if(heatOnPins[i] >= 0)
       pinModeNonDue(heatOnPins[i], OUTPUT);
-    thermistorInfRs[i] = ( thermistorInfRs[i]*exp(-thermistorBetas[i]/(25.0 - ABS_ZERO)) );
   }
 
+  for(i = 0; i < HEATERS; i++)
+    BuildThermistorTable(i);
+
   if(zProbePin >= 0)
 	  pinMode(zProbePin, INPUT);
   
@@ -197,12 +232,14 @@ void Platform::Init()
 	  analogWrite(coolingFanPin, 0);
   }
 
+  InitialiseCycleCounter();
+  InitialiseADC();
+  ResetInterruptStatistics();
   InitialiseInterrupts();
   
-  addToTime = 0.0;
+  timeOverflows = 0;
   lastTimeCall = 0;
-  lastTime = Time();
-  longWait = lastTime;
+  longWait = Time();
   
   active = true;
 }
@@ -222,10 +259,6 @@ void Platform::Spin()
   network->Spin();
   line->Spin();
 
-  if(Time() - lastTime < 0.006)
-    return;
-  PollZHeight();
-  lastTime = Time();
   ClassReport("Platform", longWait);
 
 }
@@ -236,8 +269,12 @@ void Platform::Spin()
 
 void TC3_Handler()
 {
+  Platform* platform = reprap.GetPlatform();
+  uint32_t start = platform->CycleCount();
+  platform->InterruptStarted(start);
   TC_GetStatus(TC1, 0);
   reprap.Interrupt();
+  platform->InterruptFinished(start);
 }
 
 void Platform::InitialiseInterrupts()
@@ -247,6 +284,7 @@ void Platform::InitialiseInterrupts()
   TC_Configure(TC1, 0, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK4);
   TC1->TC_CHANNEL[0].TC_IER=TC_IER_CPCS;
   TC1->TC_CHANNEL[0].TC_IDR=~TC_IER_CPCS;
+  stepTimerStopped = false;
   SetInterrupt(STANDBY_INTERRUPT_RATE);
 }
 
@@ -255,12 +293,181 @@ void Platform::DisableInterrupts()
 	NVIC_DisableIRQ(TC3_IRQn);
 }
 
+//*************************************************************************************************
+
+// Analogue inputs
+
+// Group the step pins by the PIO controller they are on.
+
+void Platform::AddStepPort(int8_t drive, Pio* port)
+{
+	int8_t p;
+	for(p = 0; p < stepPortCount; p++)
+	{
+		if(stepPortList[p] == port)
+			break;
+	}
+	if(p == stepPortCount)
+	{
+		stepPortList[p] = port;
+		stepPortMasks[p] = 0;
+		stepPortCount++;
+	}
+	stepPortIndex[drive] = p;
+	stepPortMasks[p] |= stepMasks[drive];
+}
+
+// Where a pin lives, for writing it directly.  Pins on the Duet that aren't on
+// the Due are looked up in a separate table.
+
+void Platform::PinPortAndMask(int8_t pin, bool nonDue, Pio*& port, uint32_t& mask)
+{
+	if(pin < 0)
+	{
+		port = PIOA; // Writing a mask of 0 to it does nothing
+		mask = 0;
+		return;
+	}
+	const PinDescription* pd = nonDue ? &nonDuePinDescription[pin] : &g_APinDescription[pin];
+	port = pd->pPort;
+	mask = pd->ulPin;
+}
+
+void ADC_Handler()
+{
+  reprap.GetPlatform()->ADCInterrupt();
+}
+
+// The hardware ADC channel behind an Arduino analogue pin number
+
+int8_t Platform::ADCChannel(int8_t analogPin)
+{
+  return (int8_t)g_APinDescription[A0 + analogPin].ulADCChannelNumber;
+}
+
+// Set the ADC free-running over every analogue input we use, with the PDC
+// copying the results (tagged with their channel number) into adcBuffers.
+// There is no hardware averaging on the SAM3X, so the interrupt does the
+// oversampling.  Nothing else may call analogRead() after this.
+
+void Platform::InitialiseADC()
+{
+  for(int8_t i = 0; i < ADC_CHANNELS; i++)
+  {
+	  adcSums[i] = 0;
+	  adcCounts[i] = 0;
+	  adcValues[i] = 0;
+  }
+
+  uint32_t channels = 0;
+  for(int8_t heater = 0; heater < HEATERS; heater++)
+  {
+	  tempSenseChannels[heater] = -1;
+	  if(tempSensePins[heater] >= 0)
+	  {
+		  tempSenseChannels[heater] = ADCChannel(tempSensePins[heater]);
+		  channels |= 1ul << tempSenseChannels[heater];
+	  }
+  }
+  zProbeChannel = ADCChannel(Z_PROBE_PIN); // Always sampled, as M558 can turn the probe on at any time
+  channels |= 1ul << zProbeChannel;
+
+  pmc_enable_periph_clk(ID_ADC);
+  ADC->ADC_CR = ADC_CR_SWRST;
+  ADC->ADC_MR = ADC_MR_PRESCAL(ADC_PRESCALE) | ADC_MR_STARTUP_SUT64 | ADC_MR_SETTLING_AST3 |
+		  ADC_MR_TRACKTIM(ADC_TRACK_TIME) | ADC_MR_TRANSFER(1) | ADC_MR_FREERUN_ON;
+  ADC->ADC_EMR = ADC_EMR_TAG;
+  ADC->ADC_CHDR = 0xFFFFFFFF;
+  ADC->ADC_CHER = channels;
+
+  adcBufferIndex = 0;
+  ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+  ADC->ADC_RPR = (uint32_t)adcBuffers[0];
+  ADC->ADC_RCR = ADC_BUFFER_LENGTH;
+  ADC->ADC_RNPR = (uint32_t)adcBuffers[1];
+  ADC->ADC_RNCR = ADC_BUFFER_LENGTH;
+  ADC->ADC_IDR = 0xFFFFFFFF;
+  ADC->ADC_IER = ADC_IER_ENDRX;
+  NVIC_SetPriority(ADC_IRQn, ADC_INTERRUPT_PRIORITY);
+  NVIC_EnableIRQ(ADC_IRQn);
+  ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+  ADC->ADC_CR = ADC_CR_START;
+}
+
+// A buffer has been filled and the PDC has moved on to the other one.
+// Fold the buffer into the running sums and hand it back to the PDC
+// as the next buffer.
+
+void Platform::ADCInterrupt()
+{
+  if(!(ADC->ADC_ISR & ADC_ISR_ENDRX))
+	  return;
+  uint16_t* buffer = adcBuffers[adcBufferIndex];
+  for(uint8_t i = 0; i < ADC_BUFFER_LENGTH; i++)
+  {
+	  uint16_t sample = buffer[i];
+	  uint8_t channel = (sample >> ADC_LCDR_CHNB_Pos) & (ADC_CHANNELS - 1);
+	  adcSums[channel] += sample & 0x0FFF;
+	  if(++adcCounts[channel] >= ADC_OVERSAMPLE)
+	  {
+		  adcValues[channel] = (uint16_t)(adcSums[channel] >> ADC_OVERSAMPLE_SHIFT);
+		  adcSums[channel] = 0;
+		  adcCounts[channel] = 0;
+
+		  // The Z probe, when in use, is the low stop for X and Z
+
+		  if(channel == zProbeChannel && zProbePin >= 0 && ZProbe() > zProbeADValue)
+		  {
+			  // The step interrupt can pre-empt this one.  Keep it out while latching,
+			  // or it could finish the move and arm the next in between.  (Masking
+			  // TC3 in the NVIC instead could turn it back on after DisableInterrupts().)
+
+			  __disable_irq();
+			  LatchEndStop(X_AXIS, lowHit);
+			  LatchEndStop(Z_AXIS, lowHit);
+			  __enable_irq();
+		  }
+	  }
+  }
+  ADC->ADC_RNPR = (uint32_t)buffer;
+  ADC->ADC_RNCR = ADC_BUFFER_LENGTH;
+  adcBufferIndex ^= 1;
+}
+
+// Called from the main loop (M122 S1), so keep the step interrupt, which
+// updates all this, out until it's done.
+
+void Platform::ResetInterruptStatistics()
+{
+	NVIC_DisableIRQ(TC3_IRQn);
+	interruptTimes.Init();
+	lateInterrupts = 0;
+	worstEarlyStep = 0;
+	worstLateStep = 0;
+	inInterrupt = false;
+	intervalFromInterrupt = false;
+	requestedInterval = 0;
+	lastInterruptStart = CycleCount();
+	NVIC_EnableIRQ(TC3_IRQn);
+}
+
 
 //*************************************************************************************************
 
 void Platform::Diagnostics() 
 {
   Message(HOST_MESSAGE, "Platform Diagnostics:\n"); 
+  for(int8_t heater = 0; heater < HEATERS; heater++)
+  {
+    snprintf(scratchString, STRING_LENGTH, "Heater %d thermistor table: %d points, max error %.3f C\n",
+    		heater, thermistorTables[heater].Length(), thermistorTables[heater].MaxError());
+    Message(HOST_MESSAGE, scratchString);
+  }
+  interruptTimes.Report(this, "Step interrupt");
+  float toMicroseconds = 1.0e6/CYCLES_PER_SECOND;
+  snprintf(scratchString, STRING_LENGTH, "Late interrupts: %lu, step interval error: %.1f to %.1f us\n",
+		  lateInterrupts, toMicroseconds*(float)worstEarlyStep, toMicroseconds*(float)worstLateStep);
+  Message(HOST_MESSAGE, scratchString);
 }
 
 extern char _end;
@@ -285,17 +492,89 @@ void Platform::PrintMemoryUsage()
 	Message(HOST_MESSAGE, scratchString);
 }
 
-void Platform::ClassReport(char* className, float &lastTime)
+void Platform::ClassReport(char* className, uint64_t &lastTime)
 {
 	if(!reprap.Debug())
 		return;
-	if(Time() - lastTime < LONG_TIME)
+	uint64_t now = Time();
+	if(now - lastTime < (uint64_t)(TIME_TO_REPRAP*LONG_TIME))
 		return;
-	lastTime = Time();
+	lastTime = now;
 	snprintf(scratchString, STRING_LENGTH, "Class %s spinning.\n", className);
 	Message(HOST_MESSAGE, scratchString);
 }
 
+// Start the cycle counter in the Data Watchpoint and Trace unit.  It
+// runs at the processor clock and costs nothing to read.
+
+void Platform::InitialiseCycleCounter()
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+//*************************************************************************************************
+
+// Timing statistics
+
+void TimingStatistics::Init()
+{
+	count = 0;
+	total = 0;
+	minimum = ULONG_MAX;
+	maximum = 0;
+	for(uint8_t i = 0; i < TIMING_BUCKETS; i++)
+		histogram[i] = 0;
+}
+
+// The largest number of cycles that would have been counted in a bucket.
+
+uint32_t TimingStatistics::BucketTop(uint8_t bucket) const
+{
+	if(bucket == 0)
+		return (1ul << TIMING_FIRST_OCTAVE) - 1;
+	if(bucket >= TIMING_BUCKETS - 1)
+		return maximum;
+	int8_t octave = TIMING_FIRST_OCTAVE + (bucket - 1)/4;
+	uint32_t quarter = 1ul << (octave - 2);
+	return (1ul << octave) + ((bucket - 1)%4 + 1)*quarter - 1;
+}
+
+// The interval below which the given fraction (in [0, 1]) of the
+// samples fell.  This is only as good as the bucket width.
+
+uint32_t TimingStatistics::Percentile(float fraction) const
+{
+	if(count == 0)
+		return 0;
+	unsigned long target = (unsigned long)ceilf(fraction*(float)count);
+	unsigned long sum = 0;
+	for(uint8_t i = 0; i < TIMING_BUCKETS; i++)
+	{
+		sum += histogram[i];
+		if(sum >= target)
+		{
+			uint32_t top = BucketTop(i);
+			if(top > maximum)
+				top = maximum;
+			return top;
+		}
+	}
+	return maximum;
+}
+
+// Print the statistics in microseconds
+
+void TimingStatistics::Report(Platform* platform, char* name)
+{
+	float toMicroseconds = 1.0e6/CYCLES_PER_SECOND;
+	snprintf(scratchString, STRING_LENGTH, "%s: min %.1f, avg %.1f, max %.1f, p99 %.1f us, %lu calls\n", name,
+			toMicroseconds*(float)Minimum(), toMicroseconds*Mean(), toMicroseconds*(float)Maximum(),
+			toMicroseconds*(float)Percentile(0.99), Count());
+	platform->Message(HOST_MESSAGE, scratchString);
+}
+
 
 //===========================================================================
 //=============================Thermal Settings  ============================
@@ -313,23 +592,147 @@ void Platform::ClassReport(char* className, float &lastTime)
 // then the thermistor resistance, R = V.RS/(1024 - V)
 // and the temperature, T = BETA/ln(R/R_INF)
 // To get degrees celsius (instead of kelvin) add -273.15 to T
-//#define THERMISTOR_R_INFS ( THERMISTOR_25_RS*exp(-THERMISTOR_BETAS/298.15) ) // Compute in Platform constructor
+// R_INF is computed when the lookup table is built.
 
 // Result is in degrees celsius
 
 
 float Platform::GetTemperature(int8_t heater)
 {
-  // If the ADC reading is N then for an ideal ADC, the input voltage is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
-  // So we add 0.5 to to the reading to get a better estimate of the input. But first, recognise the special case of thermistor disconnected.
+  // Recognise the special case of thermistor disconnected.
   int rawTemp = GetRawTemperature(heater);
-  if (rawTemp == AD_RANGE)
+  if (rawTemp >= AD_DISCONNECTED)
   {
          // Thermistor is disconnected
          return ABS_ZERO;
   }
-  float r = (float)rawTemp + 0.5;
-  return ABS_ZERO + thermistorBetas[heater]/log( (r*thermistorSeriesRs[heater]/((AD_RANGE + 1) - r))/thermistorInfRs[heater] );
+  return thermistorTables[heater].Temperature(rawTemp);
+}
+
+void Platform::SetThermistorParameters(int8_t heater, float r25, float beta, float seriesR)
+{
+  thermistor25Rs[heater] = r25;
+  thermistorBetas[heater] = beta;
+  thermistorSeriesRs[heater] = seriesR;
+  BuildThermistorTable(heater);
+}
+
+void Platform::BuildThermistorTable(int8_t heater)
+{
+  if(!thermistorTables[heater].Build(thermistorBetas[heater], thermistorSeriesRs[heater], thermistor25Rs[heater]))
+  {
+    snprintf(scratchString, STRING_LENGTH, "Heater %d thermistor table can't be made accurate to %.1f C; some readings will be slow or inaccurate.\n",
+    		heater, THERMISTOR_TABLE_ACCURACY);
+    Message(HOST_MESSAGE, scratchString);
+  }
+}
+
+// The Beta equation itself.  If the ADC reading is N then for an ideal ADC, the input voltage
+// is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
+// So we add 0.5 to to the reading to get a better estimate of the input.
+
+float ThermistorTable::Exact(int adc) const
+{
+  float r = (float)adc + 0.5;
+  return ABS_ZERO + beta/log( (r*seriesR/((AD_RANGE + 1) - r))/infR );
+}
+
+// How far from the exact equation does interpolating linearly between start and end
+// get?  Only a sample of the codes in between is checked, so this is cheap enough to
+// call while laying out the table, and is what MaxError() reports.
+
+float ThermistorTable::SegmentError(int start, float startTemperature, int end) const
+{
+  float endTemperature = Exact(end);
+  float slope = (endTemperature - startTemperature)/(float)(end - start);
+  float worst = 0.0;
+  for(int8_t i = 1; i <= THERMISTOR_FIT_SAMPLES; i++)
+  {
+    int adc = start + ((end - start)*i)/(THERMISTOR_FIT_SAMPLES + 1);
+    if(adc <= start)
+      continue;
+    float error = fabs(startTemperature + slope*(float)(adc - start) - Exact(adc));
+    if(error > worst)
+      worst = error;
+  }
+  return worst;
+}
+
+void ThermistorTable::AddPoint(int adc, float temperature)
+{
+  codes[length] = adc;
+  temperatures[length] = temperature;
+  slopes[length] = 0.0;
+  if(length > 0)
+    slopes[length - 1] = (temperature - temperatures[length - 1])/(float)(adc - codes[length - 1]);
+  length++;
+}
+
+// Lay out the breakpoints greedily from code 0 upwards, making each segment
+// as long as possible within tolerance.  Neighbouring segments are much the same
+// length, so the search starts from the last one's length, doubling or halving
+// until it brackets the longest that fits, then bisects.  Returns false if the
+// table fills up before the last code.
+
+bool ThermistorTable::Layout(float tolerance)
+{
+  int last = AD_DISCONNECTED - 1;
+  int start = 0;
+  int guess = 1;
+  length = 0;
+  maxError = 0.0;
+  AddPoint(start, Exact(start));
+  while(start < last)
+  {
+    if(length >= THERMISTOR_TABLE_LENGTH)
+      return false;
+    int most = last - start;
+    int good = 0;
+    int bad = most + 1;
+    float goodError = 0.0;
+    int trial = (guess < most) ? guess : most;
+    while(bad - good > 1)
+    {
+      float error = SegmentError(start, temperatures[length - 1], start + trial);
+      if(error <= tolerance)
+      {
+        good = trial;
+        goodError = error;
+        trial = (2*trial < bad) ? 2*trial : (good + bad) >> 1;
+      } else
+      {
+        bad = trial;
+        trial = (good == 0 && trial > 1) ? trial >> 1 : (good + bad) >> 1;
+      }
+    }
+    if(good == 0) // Even adjacent codes don't fit; take them anyway
+      good = 1;
+    if(goodError > maxError)
+      maxError = goodError;
+    start += good;
+    guess = good;
+    AddPoint(start, Exact(start));
+  }
+  return true;
+}
+
+// Build the table, relaxing the tolerance up to THERMISTOR_TABLE_ACCURACY if it
+// won't fit.  Returns false if the table can't be made that accurate.
+
+bool ThermistorTable::Build(float b, float rs, float r25)
+{
+  beta = b;
+  seriesR = rs;
+  infR = r25*exp(-beta/(25.0 - ABS_ZERO));
+
+  float tolerance = THERMISTOR_TABLE_TOLERANCE;
+  while(!Layout(tolerance))
+  {
+    if(tolerance >= THERMISTOR_TABLE_ACCURACY)
+      return false; // Readings beyond the end of the table use Exact(), so are still right, just slow
+    tolerance = fmin(2.0*tolerance, THERMISTOR_TABLE_ACCURACY);
+  }
+  return maxError <= THERMISTOR_TABLE_ACCURACY;
 }
 
 
@@ -352,6 +755,54 @@ void Platform::SetHeater(int8_t heater, const float& power)
 }
 
 
+// An end stop pin has changed.  If the stop is now hit and the running move
+// is watching it, latch it along with where the move had got to.
+
+void Platform::EndStopInterrupt(int8_t axis)
+{
+	if(zProbePin >= 0 && axis != Y_AXIS)
+		return; // The Z probe stands in for these stops; see ADCInterrupt()
+	if(lowStopPins[axis] >= 0 && ReadStopPin(lowStopPorts[axis], lowStopMasks[axis]))
+		LatchEndStop(axis, lowHit);
+	if(highStopPins[axis] >= 0 && ReadStopPin(highStopPorts[axis], highStopMasks[axis]))
+		LatchEndStop(axis, highHit);
+}
+
+void Platform::LatchEndStop(int8_t axis, EndStopHit esh)
+{
+	if(!endStopWatched[axis] || endStopLatches[axis] != noStop)
+		return;
+	endStopStepCounts[axis] = *endStopStepCounter;
+	endStopLatches[axis] = esh;
+	endStopTriggered = true;
+}
+
+// Called as a move starts.  A stop that is already hit won't produce an edge,
+// so look at them all once here.
+
+void Platform::ArmEndStops(const bool watch[], const volatile long* stepCounter)
+{
+	DisarmEndStops();
+	endStopStepCounter = stepCounter;
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		endStopWatched[axis] = watch[axis];
+		if(watch[axis])
+		{
+			EndStopHit esh = Stopped(axis);
+			if(esh != noStop)
+				LatchEndStop(axis, esh);
+		}
+	}
+}
+
+void Platform::DisarmEndStops()
+{
+	for(int8_t axis = 0; axis < AXES; axis++)
+		DisarmEndStop(axis);
+	endStopTriggered = false;
+}
+
 EndStopHit Platform::Stopped(int8_t drive)
 {
 	if(zProbePin >= 0)
@@ -598,7 +1049,7 @@ void FileStore::Init()
 // Open a local file (for example on an SD card).
 // This is protected - only Platform can access it.
 
-bool FileStore::Open(char* directory, char* fileName, bool write)
+bool FileStore::Open(char* directory, char* fileName, bool write, bool append)
 {
   char* location = platform->GetMassStorage()->CombineName(directory, fileName);
 
@@ -608,7 +1059,7 @@ bool FileStore::Open(char* directory, char* fileName, bool write)
 
   if(writing)
   {
-	  openReturn = f_open(&file, location, FA_CREATE_ALWAYS | FA_WRITE);
+	  openReturn = f_open(&file, location, (append ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS) | FA_WRITE);
 	  if (openReturn != FR_OK)
 	  {
 		  platform->Message(HOST_MESSAGE, "Can't open ");
@@ -619,6 +1070,8 @@ bool FileStore::Open(char* directory, char* fileName, bool write)
 		  platform->Message(HOST_MESSAGE, "\n");
 		  return false;
 	  }
+	  if(append)
+		  f_lseek(&file, file.fsize);
 	  bufferPointer = 0;
   } else
   {
@@ -673,6 +1126,20 @@ unsigned long FileStore::Length()
 	return 0;
 }
 
+// Reading, the buffer is ahead of the byte being read; writing, it hasn't been
+// written out yet.
+
+unsigned long FileStore::Position()
+{
+  if(!inUse)
+    return 0;
+  if(writing)
+    return file.fptr + bufferPointer;
+  if(bufferPointer >= FILE_BUF_LEN) // Nothing read yet, or the buffer is used up
+    return file.fptr;
+  return file.fptr - lastBufferEntry + bufferPointer;
+}
+
 int8_t FileStore::Status()
 {
   if(!inUse)
@@ -761,7 +1228,7 @@ void FileStore::Write(char* b)
 
 //-----------------------------------------------------------------------------------------------------
 
-FileStore* Platform::GetFileStore(char* directory, char* fileName, bool write)
+FileStore* Platform::GetFileStore(char* directory, char* fileName, bool write, bool append)
 {
   FileStore* result = NULL;
 
@@ -772,7 +1239,7 @@ FileStore* Platform::GetFileStore(char* directory, char* fileName, bool write)
     if(!files[i]->inUse)
     {
       files[i]->inUse = true;
-      if(files[i]->Open(directory, fileName, write))
+      if(files[i]->Open(directory, fileName, write, append))
         return files[i];
       else
       {
@@ -63,6 +63,13 @@ Licence: GPL
 #define SHORT_STRING_LENGTH 40
 #define TIME_TO_REPRAP 1.0e6 // Convert seconds to the units used by the machine (usually microseconds)
 #define TIME_FROM_REPRAP 1.0e-6 // Convert the units used by the machine (usually microseconds) to seconds
+#define CYCLES_PER_SECOND 84.0e6 // The processor clock, which drives the cycle counter used for profiling
+
+// Profiling histograms have four logarithmic buckets per power of two, starting at
+// 2^TIMING_FIRST_OCTAVE cycles.  Anything beyond the last bucket is counted in it.
+
+#define TIMING_FIRST_OCTAVE 5
+#define TIMING_BUCKETS 97
 
 /**************************************************************************************************/
 
@@ -70,6 +77,7 @@ Licence: GPL
 
 #define DRIVES 4  // The number of drives in the machine, including X, Y, and Z plus extruder drives
 #define AXES 3    // The number of movement axes in the machine, usually just X, Y and Z. <= DRIVES
+#define KINEMATICS cartesian // cartesian, coreXY, hBot or linearDelta - see Kinematics.h
 #define HEATERS 2 // The number of heaters in the machine; 0 is the heated bed even if there isn't one.
 
 // The numbers of entries in each array must correspond with the values of DRIVES,
@@ -85,6 +93,7 @@ Licence: GPL
 #define ENABLE false      // What to send to enable... 
 #define DISABLE true     // ...and disable a drive
 #define DISABLE_DRIVES {false, false, true, false} // Set true to disable a drive when it becomes idle
+#define STEP_PULSE_TIME 2.0e-6 // Seconds - the shortest a step pin is held high; A4988s need 1us, DRV8825s 1.9us
 #define LOW_STOP_PINS {11, -1, 60, 31}
 #define HIGH_STOP_PINS {-1, 28, -1, -1}
 #define ENDSTOP_HIT 1 // when a stop == this it is hit
@@ -94,10 +103,14 @@ Licence: GPL
 #define Z_PROBE_AD_VALUE 400
 #define Z_PROBE_STOP_HEIGHT 0.7 // mm
 #define Z_PROBE_PIN 0 // Analogue pin number
+#define Z_PROBE_SHIFT 4 // Converts an oversampled ADC reading to the 10-bit units of Z_PROBE_AD_VALUE
 #define MAX_FEEDRATES {50.0, 50.0, 3.0, 16.0}    // mm/sec
 #define ACCELERATIONS {800.0, 800.0, 10.0, 250.0}    // mm/sec^2
+#define JERKS {0.0, 0.0, 0.0, 0.0}    // mm/sec^3 - limit on the rate of change of acceleration; 0 gives trapezoidal moves
 #define DRIVE_STEPS_PER_UNIT {87.4890, 87.4890, 4000.0, 420.0}
 #define INSTANT_DVS {15.0, 15.0, 0.2, 2.0}    // (mm/sec)
+#define PRESSURE_ADVANCES {0.0}    // Seconds, one per extruder - extra filament pushed is this times the extrusion rate
+#define MIN_SEGMENT_TIME 0.02 // Seconds - XY moves shorter than this are slowed when the move queue runs low
 
 // AXES
 
@@ -109,6 +122,15 @@ Licence: GPL
 #define Y_AXIS 1  // The index of the Y axis
 #define Z_AXIS 2  // The index of the Z axis
 
+// Linear delta geometry, only used if KINEMATICS is linearDelta.  The X, Y and Z drives move the
+// carriages on the towers at 210, 330 and 90 degrees round the centre; their stops are high stops.
+
+#define DELTA_DIAGONAL_ROD 215.0 // mm - length of the arms, joint centre to joint centre
+#define DELTA_RADIUS 105.0 // mm - horizontal distance from the effector's arm joints to the carriages' with the nozzle central
+#define DELTA_HOMED_HEIGHT 250.0 // mm - Z with all the carriages at their high stops
+#define DELTA_SEGMENTS_PER_SECOND 200.0 // Straight lines are split into segments this often at full feedrate...
+#define DELTA_MIN_SEGMENT 0.2 // mm - ...but none shorter than this
+
 
 // HEATERS - The bed is assumed to be the first
 
@@ -120,6 +142,10 @@ Licence: GPL
 #define THERMISTOR_BETAS {3988.0, 4138.0}
 #define THERMISTOR_SERIES_RS {1000, 1000} // Ohms in series with the thermistors
 #define THERMISTOR_25_RS {10000.0, 100000.0} // Thermistor ohms at 25 C = 298.15 K
+#define THERMISTOR_TABLE_LENGTH 256 // Maximum number of points in the ADC -> temperature lookup table for each heater
+#define THERMISTOR_TABLE_TOLERANCE 0.05 // Degrees C - target accuracy of the lookup table's linear interpolation...
+#define THERMISTOR_TABLE_ACCURACY 0.1 // ...which is relaxed up to this if the table fills up
+#define THERMISTOR_FIT_SAMPLES 8 // Codes checked inside each table segment while building it
 
 #define USE_PID {false, true} // PID or bang-bang for this heater?
 #define PID_KIS {-1, 2.2} // PID constants...
@@ -135,7 +161,20 @@ Licence: GPL
 #define COOLING_FAN_PIN 34
 #define HEAT_ON 0 // 0 for inverted heater (eg Duet v0.6) 1 for not (e.g. Duet v0.4)
 
-#define AD_RANGE 1023.0//16383 // The A->D converter that measures temperatures gives an int this big as its max value
+#define AD_RANGE 16383.0 // The A->D converter that measures temperatures gives an int this big as its max value
+#define AD_DISCONNECTED 16380 // Full scale - at or above this a thermistor is disconnected (see ADC_OVERSAMPLE)
+
+// The ADC runs continuously, with the PDC copying tagged 12-bit conversions into one of two
+// buffers.  The interrupt sums ADC_OVERSAMPLE conversions per channel and shifts the sum
+// right by ADC_OVERSAMPLE_SHIFT to give a 14-bit reading.  So full-scale is 16*4095/4 = 16380.
+
+#define ADC_CHANNELS 16
+#define ADC_OVERSAMPLE 16
+#define ADC_OVERSAMPLE_SHIFT 2
+#define ADC_BUFFER_LENGTH 96 // Conversions per PDC buffer
+#define ADC_PRESCALE 20 // ADC clock = 84MHz/(2*(ADC_PRESCALE + 1)), i.e. 2MHz
+#define ADC_TRACK_TIME 15 // ADC clocks to track the input; the thermistors are a high impedance source
+#define ADC_INTERRUPT_PRIORITY 4 // Lower priority (higher number) than the step interrupt
 
 #define HOT_BED 0 // The index of the heated bed; set to -1 if there is no heated bed
 
@@ -166,7 +205,7 @@ Licence: GPL
 
 // Seconds to wait after serving a page
  
-#define CLIENT_CLOSE_DELAY 0.002
+#define CLIENT_CLOSE_DELAY 2000 // Microseconds
 
 #define HTTP_STATE_SIZE 5
 
@@ -367,6 +406,7 @@ public:
 	void Close();
 	void GoToEnd(); // Position the file at the end (so you can write on the end).
 	unsigned long Length(); // File size in bytes
+	unsigned long Position(); // Offset of the next byte to be read or written
 
 friend class Platform;
 
@@ -374,7 +414,7 @@ protected:
 
 	FileStore(Platform* p);
 	void Init();
-        bool Open(char* directory, char* fileName, bool write);
+        bool Open(char* directory, char* fileName, bool write, bool append);
         
   bool inUse;
   byte buf[FILE_BUF_LEN];
@@ -392,6 +432,70 @@ private:
 };
 
 
+// This class converts raw ADC readings from a thermistor to degrees C.  Rather than
+// work out the Beta equation (a log and some divides) on every reading, a table of
+// breakpoints over the ADC codes is built from the thermistor parameters once, and
+// readings are linearly interpolated between them.  The breakpoints are placed so
+// the interpolation stays within THERMISTOR_TABLE_TOLERANCE of the exact equation,
+// so they are close together at the ends of the range where the curve is steep.
+// If that needs more than THERMISTOR_TABLE_LENGTH points the tolerance is relaxed,
+// but not beyond THERMISTOR_TABLE_ACCURACY; Build() returns false if that fails.
+
+class ThermistorTable
+{
+public:
+
+	bool Build(float b, float rs, float r25);
+	float Temperature(int adc) const;
+	float Exact(int adc) const;
+	int Length() const;
+	float MaxError() const;
+
+private:
+
+	float SegmentError(int start, float startTemperature, int end) const;
+	bool Layout(float tolerance);
+	void AddPoint(int adc, float temperature);
+
+	float beta;
+	float seriesR;
+	float infR;
+	int length;
+	float maxError;
+	uint16_t codes[THERMISTOR_TABLE_LENGTH];
+	float temperatures[THERMISTOR_TABLE_LENGTH];
+	float slopes[THERMISTOR_TABLE_LENGTH];
+};
+
+// This class accumulates the distribution of a set of intervals measured in
+// processor cycles.  The samples themselves are not kept; the histogram is
+// enough to estimate percentiles to within a quarter of an octave.
+
+class TimingStatistics
+{
+public:
+
+	void Init();
+	void Record(uint32_t cycles);
+	unsigned long Count() const;
+	uint32_t Minimum() const;
+	uint32_t Maximum() const;
+	float Mean() const;
+	uint32_t Percentile(float fraction) const;
+	void Report(Platform* platform, char* name);
+
+private:
+
+	uint8_t Bucket(uint32_t cycles) const;
+	uint32_t BucketTop(uint8_t bucket) const;
+
+	unsigned long count;
+	uint64_t total;
+	uint32_t minimum;
+	uint32_t maximum;
+	uint32_t histogram[TIMING_BUCKETS];
+};
+
 /***************************************************************************************************************/
 
 // The main class that defines the RepRap machine for the benefit of the other classes
@@ -421,16 +525,27 @@ class Platform
   
   void PrintMemoryUsage();  // Print memory stats for debugging
 
-  void ClassReport(char* className, float &lastTime);  // Called on return to check everything's live.
+  void ClassReport(char* className, uint64_t &lastTime);  // Called on return to check everything's live.
 
   // Timing
   
-  float Time(); // Returns elapsed seconds since some arbitrary time
-  
+  uint64_t Time(); // Returns elapsed microseconds since some arbitrary time; never wraps in practice
+
+  uint32_t CycleCount(); // Returns processor cycles since some arbitrary time; wraps every 2^32 cycles
+
   void SetInterrupt(float s); // Set a regular interrupt going every s seconds; if s is -ve turn interrupt off
+  void StopStepTimer(); // No more interrupts until SetInterrupt() or...
+  void KickStepTimer(); // ...this, which makes one happen straight away if the timer is stopped
   
   void DisableInterrupts();
 
+  void ADCInterrupt(); // Called by the ADC interrupt when a buffer of conversions is complete
+  void EndStopInterrupt(int8_t axis); // Called when one of an axis's end stop pins changes
+
+  void InterruptStarted(uint32_t start); // Called by the step interrupt on entry and exit for profiling
+  void InterruptFinished(uint32_t start);
+  void ResetInterruptStatistics();
+
   // Communications and data storage
   
   Network* GetNetwork();
@@ -445,7 +560,7 @@ class Platform
   friend class FileStore;
   
   MassStorage* GetMassStorage();
-  FileStore* GetFileStore(char* directory, char* fileName, bool write);
+  FileStore* GetFileStore(char* directory, char* fileName, bool write, bool append = false);
   void StartNetwork();
   char* GetWebDir(); // Where the htm etc files are
   char* GetGCodeDir(); // Where the gcodes are
@@ -461,23 +576,50 @@ class Platform
   // Movement
   
   void EmergencyStop();
-  void SetDirection(byte drive, bool direction);
-  void Step(byte drive);
-  void Disable(byte drive); // There is no drive enable; drives get enabled automatically the first time they are used.
+  void SetDirection(byte drive, bool direction); // Only writes the pin if the direction changes
+  void AddStep(byte drive, uint32_t portMasks[]); // Add a drive to the ones to step this tick, grouped by port...
+  void RemoveStep(byte drive, uint32_t portMasks[]);
+  void StepPorts(uint32_t portMasks[]); // ...and raise all their step pins at once; EndStepPulses() lowers them
+  void EndStepPulses();
+  int8_t StepPortCount();
+  void Enable(byte drive);  // Call before stepping a drive; does nothing if it is already enabled
+  void Disable(byte drive);
   void SetMotorCurrent(byte drive, float current);
   float DriveStepsPerUnit(int8_t drive);
+  float DriveUnitsPerStep(int8_t drive); // The reciprocal, cached so conversions from steps multiply rather than divide
   void SetDriveStepsPerUnit(int8_t drive, float value);
   float Acceleration(int8_t drive);
   void SetAcceleration(int8_t drive, float value);
+  float Jerk(int8_t drive);
+  void SetJerk(int8_t drive, float value);
   float MaxFeedrate(int8_t drive);
   void SetMaxFeedrate(int8_t drive, float value);
   float InstantDv(int8_t drive);
+  float PressureAdvance(int8_t extruder);
+  float MinSegmentTime();
+  void SetMinSegmentTime(float value);
+  void SetPressureAdvance(int8_t extruder, float value);
   float HomeFeedRate(int8_t axis);
   void SetHomeFeedRate(int8_t axis, float value);
   EndStopHit Stopped(int8_t drive);
+  void ArmEndStops(const bool watch[], const volatile long* stepCounter); // Latch hits on these axes from now on...
+  void DisarmEndStops();
+  void DisarmEndStop(int8_t axis);
+  bool EndStopTriggered(); // ...when this becomes true...
+  void ClearEndStopTrigger();
+  EndStopHit LatchedEndStop(int8_t axis); // ...and these say which stop...
+  long EndStopStepCount(int8_t axis); // ...and how many steps into the move it was
   float AxisLength(int8_t axis);
   void SetAxisLength(int8_t axis, float value);
   bool HighStopButNotLow(int8_t axis);
+  float DeltaDiagonal();
+  void SetDeltaDiagonal(float value);
+  float DeltaRadius();
+  void SetDeltaRadius(float value);
+  float DeltaHomedHeight();
+  void SetDeltaHomedHeight(float value);
+  float DeltaSegmentsPerSecond();
+  void SetDeltaSegmentsPerSecond(float value);
   
   float ZProbeStopHeight();
   void SetZProbeStopHeight(float z);
@@ -488,6 +630,10 @@ class Platform
   // Heat and temperature
   
   float GetTemperature(int8_t heater); // Result is in degrees celsius
+  void SetThermistorParameters(int8_t heater, float r25, float beta, float seriesR); // Rebuilds the lookup table
+  float GetThermistor25R(int8_t heater);
+  float GetThermistorBeta(int8_t heater);
+  float GetThermistorSeriesR(int8_t heater);
   void SetHeater(int8_t heater, const float& power); // power is a fraction in [0,1]
   float PidKp(int8_t heater);
   float PidKi(int8_t heater);
@@ -498,6 +644,7 @@ class Platform
   float DMix(int8_t heater);
   bool UsePID(int8_t heater);
   float HeatSampleTime();
+  uint64_t HeatSampleTicks();
   void CoolingFan(float speed);
   //void SetHeatOn(int8_t ho); //TEMPORARY - this will go away...
 
@@ -508,9 +655,20 @@ class Platform
   
   private:
   
-  float lastTime;
-  float longWait;
-  float addToTime;
+  uint64_t longWait;
+  unsigned long timeOverflows;
+
+// Step interrupt profiling - all times are in processor cycles
+
+  TimingStatistics interruptTimes;
+  volatile unsigned long lateInterrupts;
+  volatile int32_t worstEarlyStep;
+  volatile int32_t worstLateStep;
+  volatile uint32_t lastInterruptStart;
+  volatile uint32_t requestedInterval;
+  volatile bool inInterrupt;
+  volatile bool intervalFromInterrupt;
+  volatile bool stepTimerStopped;
   unsigned long lastTimeCall;
   
   bool active;
@@ -518,7 +676,15 @@ class Platform
   Compatibility compatibility;
 
   void InitialiseInterrupts();
-  int GetRawZHeight();
+  void InitialiseCycleCounter();
+  void InitialiseADC();
+  int8_t ADCChannel(int8_t analogPin);
+  void PinPortAndMask(int8_t pin, bool nonDue, Pio*& port, uint32_t& mask);
+  void AddStepPort(int8_t drive, Pio* port);
+  void BuildThermistorTable(int8_t heater);
+  static bool ReadStopPin(Pio* port, uint32_t mask);
+  void LatchEndStop(int8_t axis, EndStopHit esh);
+  static void WritePin(Pio* port, uint32_t mask, bool high);
   
 // DRIVES
 
@@ -527,32 +693,56 @@ class Platform
   int8_t enablePins[DRIVES];
   bool disableDrives[DRIVES];
   bool driveEnabled[DRIVES];
+  bool driveDirections[DRIVES];   // What the direction pins are set to
+  int8_t stepPortIndex[DRIVES];   // Which of stepPortList each drive's step pin is on
+  uint32_t stepMasks[DRIVES];     // The bit masks and PIO controllers of the drive pins, so
+  Pio* directionPorts[DRIVES];    // they can be written directly without the Arduino pin
+  uint32_t directionMasks[DRIVES]; // look-up.  Absent pins have a mask of 0.
+  Pio* enablePorts[DRIVES];
+  uint32_t enableMasks[DRIVES];
+  int8_t stepPortCount;           // The different PIO controllers the step pins are on...
+  Pio* stepPortList[DRIVES];
+  uint32_t stepPortMasks[DRIVES]; // ...and all the step pins on each
+  uint32_t stepPulseStart;        // When the step pins last went high (processor cycles)
   int8_t lowStopPins[DRIVES];
   int8_t highStopPins[DRIVES];
+  Pio* lowStopPorts[AXES];        // The stop pins, read directly by the pin change interrupt
+  uint32_t lowStopMasks[AXES];
+  Pio* highStopPorts[AXES];
+  uint32_t highStopMasks[AXES];
+  volatile bool endStopWatched[AXES];  // The axes whose stops the running move wants to know about
+  volatile int8_t endStopLatches[AXES]; // An EndStopHit for each axis, held from when the stop triggers...
+  volatile long endStopStepCounts[AXES]; // ...with the move's step count then
+  volatile bool endStopTriggered;       // Set whenever a latch is
+  const volatile long* endStopStepCounter;
   float maxFeedrates[DRIVES];  
   float accelerations[DRIVES];
+  float jerks[DRIVES];
   float driveStepsPerUnit[DRIVES];
+  float unitsPerDriveStep[DRIVES];
   float instantDvs[DRIVES];
+  float pressureAdvances[DRIVES - AXES];
+  float minSegmentTime;
   MCP4461 mcp;
   int8_t potWipes[DRIVES];
   float senseResistor;
   float maxStepperDigipotVoltage;
 //  float zProbeGradient;
 //  float zProbeConstant;
-  long zProbeValue;
   int8_t zProbePin;
-  int8_t zProbeCount;
-  long zProbeSum;
+  int8_t zProbeChannel;
   int zProbeADValue;
   float zProbeStopHeight;
 
 // AXES
 
-  void PollZHeight();
-
   float axisLengths[AXES];
   float homeFeedrates[AXES];
   float headOffsets[AXES]; // FIXME - needs a 2D array
+  float deltaDiagonal;
+  float deltaRadius;
+  float deltaHomedHeight;
+  float deltaSegmentsPerSecond;
 //  bool zProbeStarting;
 //  float zProbeHigh;
 //  float zProbeLow;
@@ -562,10 +752,20 @@ class Platform
   int GetRawTemperature(byte heater);
 
   int8_t tempSensePins[HEATERS];
+  int8_t tempSenseChannels[HEATERS];
   int8_t heatOnPins[HEATERS];
   float thermistorBetas[HEATERS];
   float thermistorSeriesRs[HEATERS];
-  float thermistorInfRs[HEATERS];
+  float thermistor25Rs[HEATERS];
+  ThermistorTable thermistorTables[HEATERS];
+
+// ADC - written by the ADC interrupt, read anywhere
+
+  uint16_t adcBuffers[2][ADC_BUFFER_LENGTH];
+  int8_t adcBufferIndex;
+  uint32_t adcSums[ADC_CHANNELS];
+  uint8_t adcCounts[ADC_CHANNELS];
+  volatile uint16_t adcValues[ADC_CHANNELS];
   bool usePID[HEATERS];
   float pidKis[HEATERS];
   float pidKds[HEATERS];
@@ -575,6 +775,7 @@ class Platform
   float pidMax[HEATERS];
   float dMix[HEATERS];
   float heatSampleTime;
+  uint64_t heatSampleTicks;
   float standbyTemperatures[HEATERS];
   float activeTemperatures[HEATERS];
   int8_t coolingFanPin;
@@ -609,15 +810,24 @@ class Platform
   byte gateWay[4];
 };
 
-// Seconds
+// Microseconds.  micros() wraps every 2^32 us (about 71 minutes), so count
+// the wraps in the top half.  This relies on Time() being called at least
+// once per wrap, which the main loop guarantees.
 
-inline float Platform::Time()
+inline uint64_t Platform::Time()
 {
   unsigned long now = micros();
   if(now < lastTimeCall) // Has timer overflowed?
-	  addToTime += ((float)ULONG_MAX)*TIME_FROM_REPRAP;
+	  timeOverflows++;
   lastTimeCall = now;
-  return addToTime + TIME_FROM_REPRAP*(float)now;
+  return (((uint64_t)timeOverflows) << 32) | (uint64_t)now;
+}
+
+// The Cortex-M3 cycle counter - one register read
+
+inline uint32_t Platform::CycleCount()
+{
+  return DWT->CYCCNT;
 }
 
 inline void Platform::Exit()
@@ -690,9 +900,15 @@ inline float Platform::DriveStepsPerUnit(int8_t drive)
   return driveStepsPerUnit[drive]; 
 }
 
+inline float Platform::DriveUnitsPerStep(int8_t drive)
+{
+  return unitsPerDriveStep[drive];
+}
+
 inline void Platform::SetDriveStepsPerUnit(int8_t drive, float value)
 {
   driveStepsPerUnit[drive] = value;
+  unitsPerDriveStep[drive] = 1.0/value;
 }
 
 inline float Platform::Acceleration(int8_t drive)
@@ -705,58 +921,151 @@ inline void Platform::SetAcceleration(int8_t drive, float value)
 	accelerations[drive] = value;
 }
 
+inline float Platform::Jerk(int8_t drive)
+{
+	return jerks[drive];
+}
+
+inline void Platform::SetJerk(int8_t drive, float value)
+{
+	jerks[drive] = value;
+}
+
 inline float Platform::InstantDv(int8_t drive)
 {
   return instantDvs[drive]; 
 }
 
+inline float Platform::PressureAdvance(int8_t extruder)
+{
+	return pressureAdvances[extruder];
+}
+
+inline void Platform::SetPressureAdvance(int8_t extruder, float value)
+{
+	pressureAdvances[extruder] = value;
+}
+
+inline float Platform::MinSegmentTime()
+{
+	return minSegmentTime;
+}
+
+inline void Platform::SetMinSegmentTime(float value)
+{
+	minSegmentTime = value;
+}
+
 inline bool Platform::HighStopButNotLow(int8_t axis)
 {
 	return (lowStopPins[axis] < 0)  && (highStopPins[axis] >= 0);
 }
 
+inline bool Platform::ReadStopPin(Pio* port, uint32_t mask)
+{
+	return ((port->PIO_PDSR & mask) ? 1 : 0) == ENDSTOP_HIT;
+}
+
+// The end stop interrupts only ever set the latches and the trigger.  Clearing
+// the trigger before looking at the latches means a stop that hits while they are
+// being looked at is seen on the next step.
+
+inline bool Platform::EndStopTriggered()
+{
+	return endStopTriggered;
+}
+
+inline void Platform::ClearEndStopTrigger()
+{
+	endStopTriggered = false;
+}
+
+inline EndStopHit Platform::LatchedEndStop(int8_t axis)
+{
+	return (EndStopHit)endStopLatches[axis];
+}
+
+inline long Platform::EndStopStepCount(int8_t axis)
+{
+	return endStopStepCounts[axis];
+}
+
+inline void Platform::DisarmEndStop(int8_t axis)
+{
+	endStopWatched[axis] = false;
+	endStopLatches[axis] = noStop;
+}
+
+inline void Platform::WritePin(Pio* port, uint32_t mask, bool high)
+{
+	if(high)
+		port->PIO_SODR = mask;
+	else
+		port->PIO_CODR = mask;
+}
+
 inline void Platform::SetDirection(byte drive, bool direction)
 {
-	if(directionPins[drive] < 0)
+	if(direction == driveDirections[drive])
 		return;
-	if(drive == AXES)
-		digitalWriteNonDue(directionPins[drive], direction);
-	else
-		digitalWrite(directionPins[drive], direction);
+	WritePin(directionPorts[drive], directionMasks[drive], direction);
+	driveDirections[drive] = direction;
+}
+
+inline void Platform::Enable(byte drive)
+{
+	if(driveEnabled[drive])
+		return;
+	WritePin(enablePorts[drive], enableMasks[drive], ENABLE);
+	driveEnabled[drive] = true;
 }
 
 inline void Platform::Disable(byte drive)
 {
-	if(enablePins[drive] < 0)
-		  return;
-	if(drive >= Z_AXIS)
-		digitalWriteNonDue(enablePins[drive], DISABLE);
-	else
-		digitalWrite(enablePins[drive], DISABLE);
+	WritePin(enablePorts[drive], enableMasks[drive], DISABLE);
 	driveEnabled[drive] = false;
 }
 
-inline void Platform::Step(byte drive)
+// The drivers step on the rising edge.  Steps for a tick are collected in a mask
+// for each port (portMasks[] has StepPortCount() entries, zeroed beforehand) so
+// that all the drives on a port step together with one register write.  The pins
+// are lowered again at the end of the step interrupt, which gives a pulse long
+// enough for the drivers.
+
+inline int8_t Platform::StepPortCount()
 {
-	if(stepPins[drive] < 0)
-		return;
-	if(!driveEnabled[drive] && enablePins[drive] >= 0)
-	{
-		if(drive >= Z_AXIS)
-			digitalWriteNonDue(enablePins[drive], ENABLE);
-		else
-			digitalWrite(enablePins[drive], ENABLE);
-		driveEnabled[drive] = true;
-	}
-	if(drive == AXES)
-	{
-		digitalWriteNonDue(stepPins[drive], 0);
-		digitalWriteNonDue(stepPins[drive], 1);
-	} else
+	return stepPortCount;
+}
+
+inline void Platform::AddStep(byte drive, uint32_t portMasks[])
+{
+	portMasks[stepPortIndex[drive]] |= stepMasks[drive];
+}
+
+inline void Platform::RemoveStep(byte drive, uint32_t portMasks[])
+{
+	portMasks[stepPortIndex[drive]] &= ~stepMasks[drive];
+}
+
+inline void Platform::StepPorts(uint32_t portMasks[])
+{
+	for(int8_t port = 0; port < stepPortCount; port++)
 	{
-		digitalWrite(stepPins[drive], 0);
-		digitalWrite(stepPins[drive], 1);
+		if(portMasks[port])
+			stepPortList[port]->PIO_SODR = portMasks[port];
 	}
+	stepPulseStart = CycleCount();
+}
+
+// However little has happened since StepPorts(), the pulses are at least
+// STEP_PULSE_TIME long.
+
+inline void Platform::EndStepPulses()
+{
+	while(CycleCount() - stepPulseStart < (uint32_t)(STEP_PULSE_TIME*CYCLES_PER_SECOND))
+		;
+	for(int8_t port = 0; port < stepPortCount; port++)
+		stepPortList[port]->PIO_CODR = stepPortMasks[port];
 }
 
 // current is in mA
@@ -772,6 +1081,46 @@ inline void Platform::SetMotorCurrent(byte drive, float current)
 	mcp.setVolatileWiper(potWipes[drive], pot);
 }
 
+inline float Platform::DeltaDiagonal()
+{
+	return deltaDiagonal;
+}
+
+inline void Platform::SetDeltaDiagonal(float value)
+{
+	deltaDiagonal = value;
+}
+
+inline float Platform::DeltaRadius()
+{
+	return deltaRadius;
+}
+
+inline void Platform::SetDeltaRadius(float value)
+{
+	deltaRadius = value;
+}
+
+inline float Platform::DeltaHomedHeight()
+{
+	return deltaHomedHeight;
+}
+
+inline void Platform::SetDeltaHomedHeight(float value)
+{
+	deltaHomedHeight = value;
+}
+
+inline float Platform::DeltaSegmentsPerSecond()
+{
+	return deltaSegmentsPerSecond;
+}
+
+inline void Platform::SetDeltaSegmentsPerSecond(float value)
+{
+	deltaSegmentsPerSecond = value;
+}
+
 inline float Platform::HomeFeedRate(int8_t axis)
 {
   return homeFeedrates[axis];
@@ -802,16 +1151,14 @@ inline void Platform::SetMaxFeedrate(int8_t drive, float value)
 	maxFeedrates[drive] = value;
 }
 
-inline int Platform::GetRawZHeight()
-{
-  if(zProbePin >= 0)
-    return analogRead(zProbePin);
-  return 0;
-}
+// The latest oversampled Z probe reading, scaled to the units of Z_PROBE_AD_VALUE.
+// This is safe to call from the step interrupt.
 
 inline long Platform::ZProbe()
 {
-	return zProbeValue;
+	if(zProbePin < 0)
+		return 0;
+	return adcValues[zProbeChannel] >> Z_PROBE_SHIFT;
 }
 
 inline float Platform::ZProbeStopHeight()
@@ -837,18 +1184,6 @@ inline void Platform::SetZProbeType(int pt)
 		zProbePin = -1;
 }
 
-inline void Platform::PollZHeight()
-{
-	if(zProbeCount >= 5)
-	{
-		zProbeValue = zProbeSum/5;
-		zProbeSum = 0;
-		zProbeCount = 0;
-	}
-	zProbeSum += GetRawZHeight();
-	zProbeCount++;
-}
-
 
 //********************************************************************************************************
 
@@ -857,15 +1192,35 @@ inline void Platform::PollZHeight()
 inline int Platform::GetRawTemperature(byte heater)
 {
   if(tempSensePins[heater] >= 0)
-    return analogRead(tempSensePins[heater]);
+    return adcValues[tempSenseChannels[heater]];
   return 0;
 }
 
+inline float Platform::GetThermistor25R(int8_t heater)
+{
+  return thermistor25Rs[heater];
+}
+
+inline float Platform::GetThermistorBeta(int8_t heater)
+{
+  return thermistorBetas[heater];
+}
+
+inline float Platform::GetThermistorSeriesR(int8_t heater)
+{
+  return thermistorSeriesRs[heater];
+}
+
 inline float Platform::HeatSampleTime()
 {
   return heatSampleTime; 
 }
 
+inline uint64_t Platform::HeatSampleTicks()
+{
+  return heatSampleTicks;
+}
+
 inline bool Platform::UsePID(int8_t heater)
 {
   return usePID[heater];
@@ -936,9 +1291,60 @@ inline void Platform::SetInterrupt(float s) // Seconds
   TC_SetRA(TC1, 0, rc/2); //50% high, 50% low
   TC_SetRC(TC1, 0, rc);
   TC_Start(TC1, 0);
+  requestedInterval = (uint32_t)(s*(float)CYCLES_PER_SECOND);
+  intervalFromInterrupt = inInterrupt;
+  stepTimerStopped = false;
   NVIC_EnableIRQ(TC3_IRQn);
 }
 
+// With nothing to step there is no point in interrupting.  The interrupt stays
+// enabled in the NVIC, so it can still be made pending by hand.
+
+inline void Platform::StopStepTimer()
+{
+  TC_Stop(TC1, 0);
+  intervalFromInterrupt = false; // The time to the next interrupt isn't a step interval
+  stepTimerStopped = true;
+}
+
+inline void Platform::KickStepTimer()
+{
+  if(stepTimerStopped)
+  {
+	  stepTimerStopped = false;
+	  NVIC_SetPendingIRQ(TC3_IRQn);
+  }
+}
+
+// The step interval error is how far the time between two successive
+// interrupts was from what the first of them asked for.  It is only
+// meaningful when the interval was set from inside the interrupt.
+
+inline void Platform::InterruptStarted(uint32_t start)
+{
+  if(intervalFromInterrupt)
+  {
+	  int32_t error = (int32_t)(start - lastInterruptStart - requestedInterval);
+	  if(error > worstLateStep)
+		  worstLateStep = error;
+	  if(error < worstEarlyStep)
+		  worstEarlyStep = error;
+  }
+  lastInterruptStart = start;
+  inInterrupt = true;
+}
+
+// If the timer compare has already happened again while we were in the
+// interrupt, the next step is late before it has even started.
+
+inline void Platform::InterruptFinished(uint32_t start)
+{
+  inInterrupt = false;
+  interruptTimes.Record(CycleCount() - start);
+  if(NVIC_GetPendingIRQ(TC3_IRQn))
+	  lateInterrupts++;
+}
+
 //****************************************************************************************************************
 
 inline Network* Platform::GetNetwork()
@@ -1036,6 +1442,97 @@ inline void Platform::PopMessageIndent()
 }
 
 
+//***************************************************************************************
+
+// Thermistor tables
+
+// Readings beyond the last breakpoint (only possible if the table filled
+// up) fall back to the exact equation.
+
+inline float ThermistorTable::Temperature(int adc) const
+{
+	if(adc >= codes[length - 1])
+	{
+		if(adc == codes[length - 1])
+			return temperatures[length - 1];
+		return Exact(adc);
+	}
+	int low = 0;
+	int high = length - 1;
+	while(high - low > 1)
+	{
+		int mid = (low + high) >> 1;
+		if(codes[mid] <= adc)
+			low = mid;
+		else
+			high = mid;
+	}
+	return temperatures[low] + slopes[low]*(float)(adc - codes[low]);
+}
+
+inline int ThermistorTable::Length() const
+{
+	return length;
+}
+
+inline float ThermistorTable::MaxError() const
+{
+	return maxError;
+}
+
+//***************************************************************************************
+
+// Timing statistics
+
+// Bucket 0 is everything below 2^TIMING_FIRST_OCTAVE cycles; after that each
+// octave is split into quarters using the two bits below the most significant one.
+
+inline uint8_t TimingStatistics::Bucket(uint32_t cycles) const
+{
+	if(cycles < (1ul << TIMING_FIRST_OCTAVE))
+		return 0;
+	int8_t octave = 31 - __builtin_clz(cycles);
+	uint32_t b = ((octave - TIMING_FIRST_OCTAVE) << 2) + ((cycles >> (octave - 2)) & 3) + 1;
+	if(b >= TIMING_BUCKETS)
+		b = TIMING_BUCKETS - 1;
+	return (uint8_t)b;
+}
+
+inline void TimingStatistics::Record(uint32_t cycles)
+{
+	count++;
+	total += cycles;
+	if(cycles < minimum)
+		minimum = cycles;
+	if(cycles > maximum)
+		maximum = cycles;
+	histogram[Bucket(cycles)]++;
+}
+
+inline unsigned long TimingStatistics::Count() const
+{
+	return count;
+}
+
+inline uint32_t TimingStatistics::Minimum() const
+{
+	if(count == 0)
+		return 0;
+	return minimum;
+}
+
+inline uint32_t TimingStatistics::Maximum() const
+{
+	return maximum;
+}
+
+inline float TimingStatistics::Mean() const
+{
+	if(count == 0)
+		return 0.0;
+	return (float)total/(float)count;
+}
+
 //***************************************************************************************
 
 //queries the PHY for link status, true = link is up, false, link is down or there is some other error
@@ -194,6 +194,8 @@ void RepRap::Init()
   platform->Message(HOST_MESSAGE, "\n");
   platform->Message(HOST_MESSAGE, NAME);
   platform->Message(HOST_MESSAGE, " is up and running.\n");
+
+  ResetTimingStatistics();
 }
 
 void RepRap::Exit()
@@ -207,20 +209,110 @@ void RepRap::Exit()
   platform->Exit();
 }
 
+// The main loop is a simple cooperative scheduler.  Platform does the low-level
+// I/O once per pass.  Heat has a period (the heat sample time) and runs when it
+// is due.  Move has a deadline: when the DDA ring falls below DDA_RING_WATERMARK
+// it is run until the ring is topped up, otherwise it gets one turn.  GCodes and
+// Webserver are best-effort; they are called repeatedly for up to their time
+// slice each, but give way as soon as Move or Heat needs the processor.
+
 void RepRap::Spin()
 {
   if(!active)
     return;
 
   platform->Spin();
-  webserver->Spin();
-  gCodes->Spin();
-  move->Spin();
-  heat->Spin();
+  EndSpin(platformModule);
+
+  if(heat->Due())
+  {
+    heat->Spin();
+    EndSpin(heatModule);
+  }
+
+  int8_t moveSpins = 0;
+  do
+  {
+    move->Spin();
+    moveSpins++;
+  } while(move->Urgent() && moveSpins < MAX_MOVE_SPINS);
+  EndSpin(moveModule);
+
+  uint32_t start = platform->CycleCount();
+  uint32_t budget = TimeSliceCycles(GCODES_TIME_SLICE);
+  do
+  {
+    gCodes->Spin();
+  } while(!Preempt() && platform->CycleCount() - start < budget);
+  move->LogUnderruns(); // SD card writing, so it goes in with the G Code file reading
+  EndSpin(gCodesModule);
+
+  start = platform->CycleCount();
+  budget = TimeSliceCycles(WEBSERVER_TIME_SLICE);
+  do
+  {
+    webserver->Spin();
+  } while(!Preempt() && platform->CycleCount() - start < budget);
+  EndSpin(webserverModule);
+
+  EndLoop();
+}
+
+// The names of the modules, in the order of the Module enum
+
+static char* moduleNames[numberOfModules] = { "Platform", "Webserver", "GCodes", "Move", "Heat" };
+
+// Called at the end of each pass round the main loop.  The loop period is
+// the time between successive calls; the module that took longest in the
+// worst loop so far is remembered so we know who to blame.
+
+void RepRap::EndLoop()
+{
+  uint32_t now = platform->CycleCount();
+  uint32_t cycles = now - loopStartCycleCount;
+  if(cycles > loopTimes.Maximum())
+    slowestModuleInWorstLoop = slowestModuleThisLoop;
+  loopTimes.Record(cycles);
+  loopStartCycleCount = now;
+  lastCycleCount = now;
+  longestSpinThisLoop = 0;
+}
+
+void RepRap::ResetTimingStatistics()
+{
+  for(int8_t i = 0; i < numberOfModules; i++)
+    spinTimes[i].Init();
+  loopTimes.Init();
+  platform->ResetInterruptStatistics();
+  longestSpinThisLoop = 0;
+  slowestModuleThisLoop = platformModule;
+  slowestModuleInWorstLoop = platformModule;
+  timingStartTime = platform->Time();
+  lastCycleCount = platform->CycleCount();
+  loopStartCycleCount = lastCycleCount;
+}
+
+// Report where the main loop spends its time.  All figures are
+// since the last reset (boot, or M122 S1).
+
+void RepRap::TimingDiagnostics()
+{
+  platform->Message(HOST_MESSAGE, "Main loop Spin() times:\n");
+  for(int8_t i = 0; i < numberOfModules; i++)
+    spinTimes[i].Report(platform, moduleNames[i]);
+  loopTimes.Report(platform, "Loop period");
+  float elapsed = TIME_FROM_REPRAP*(float)(platform->Time() - timingStartTime);
+  float loopsPerSecond = 0.0;
+  if(elapsed > 0.0)
+    loopsPerSecond = (float)loopTimes.Count()/elapsed;
+  snprintf(scratchString, STRING_LENGTH, "Worst loop %.1f us, mostly in %s; %.0f loops/s\n",
+		  1.0e6*(float)loopTimes.Maximum()/CYCLES_PER_SECOND, moduleNames[slowestModuleInWorstLoop], loopsPerSecond);
+  platform->Message(HOST_MESSAGE, scratchString);
 }
 
 void RepRap::Diagnostics()
 {
+  TimingDiagnostics();
   platform->Diagnostics();
   move->Diagnostics();
   heat->Diagnostics();
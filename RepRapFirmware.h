@@ -52,6 +52,7 @@ extern char scratchString[];
 #include "Platform.h"
 #include "Webserver.h"
 #include "GCodes.h"
+#include "Kinematics.h"
 #include "Move.h"
 #include "Heat.h"
 #include "Reprap.h"
@@ -21,6 +21,25 @@ Licence: GPL
 #ifndef REPRAP_H
 #define REPRAP_H
 
+// The most time (in microseconds) that the best-effort modules may take in
+// one pass round the main loop before Move and Heat get another look in.
+
+#define WEBSERVER_TIME_SLICE 200
+#define GCODES_TIME_SLICE 200
+#define MAX_MOVE_SPINS (2*DDA_RING_LENGTH) // Upper bound on Move::Spin() calls to refill the DDA ring in one go
+
+// The classes whose Spin() functions are called from RepRap::Spin(), for profiling
+
+enum Module
+{
+	platformModule = 0,
+	webserverModule = 1,
+	gCodesModule = 2,
+	moveModule = 3,
+	heatModule = 4,
+	numberOfModules = 5
+};
+
 class RepRap
 {    
   public:
@@ -32,6 +51,7 @@ class RepRap
     void Exit();
     void Interrupt();
     void Diagnostics();
+    void ResetTimingStatistics();
     bool Debug();
     void SetDebug(bool d);
     Platform* GetPlatform();
@@ -41,6 +61,12 @@ class RepRap
     Webserver* GetWebserver();  
     
   private:
+
+    void EndSpin(Module module);
+    void EndLoop();
+    bool Preempt();
+    uint32_t TimeSliceCycles(float microseconds);
+    void TimingDiagnostics();
   
     Platform* platform;
     bool active;
@@ -49,6 +75,17 @@ class RepRap
     GCodes* gCodes;
     Webserver* webserver;
     bool debug;
+
+    // Main loop profiling - all times are in processor cycles
+
+    TimingStatistics spinTimes[numberOfModules];
+    TimingStatistics loopTimes;
+    uint32_t lastCycleCount;
+    uint32_t loopStartCycleCount;
+    uint32_t longestSpinThisLoop;
+    Module slowestModuleThisLoop;
+    Module slowestModuleInWorstLoop;
+    uint64_t timingStartTime;
 };
 
 inline Platform* RepRap::GetPlatform() { return platform; }
@@ -70,6 +107,33 @@ inline void RepRap::SetDebug(bool d)
 
 inline void RepRap::Interrupt() { move->Interrupt(); }
 
+// A best-effort module should give up its time slice if it is holding up one with a deadline.
+
+inline bool RepRap::Preempt()
+{
+	return move->Urgent() || heat->Due();
+}
+
+inline uint32_t RepRap::TimeSliceCycles(float microseconds)
+{
+	return (uint32_t)(microseconds*1.0e-6*CYCLES_PER_SECOND);
+}
+
+// Record how long the Spin() function of a module just took.
+
+inline void RepRap::EndSpin(Module module)
+{
+	uint32_t now = platform->CycleCount();
+	uint32_t cycles = now - lastCycleCount;
+	spinTimes[module].Record(cycles);
+	if(cycles > longestSpinThisLoop)
+	{
+		longestSpinThisLoop = cycles;
+		slowestModuleThisLoop = module;
+	}
+	lastCycleCount = now;
+}
+
 
 #endif
 
@@ -75,8 +75,8 @@ class Webserver
     
     Platform* platform;
     bool active;
-    float lastTime;
-    float longWait;
+    uint64_t lastTime;
+    uint64_t longWait;
     FileStore* fileBeingSent;
     bool writing;
     bool receivingPost;
@@ -87,7 +87,7 @@ class Webserver
     bool postSeen;
     bool getSeen;
     bool clientLineIsBlank;
-    float clientCloseTime;
+    uint64_t clientCloseTime;
     bool needToCloseClient;
 
     char clientLine[STRING_LENGTH];